@@ -0,0 +1,276 @@
+#include <WebSocketClient.h>
+#include <WebSocketServer.h>
+#include <base64/Base64.h>
+using namespace net;
+
+// Measures the hot paths of the library on the board itself and prints the
+// results as CSV (one line per benchmark and payload size):
+//
+//   benchmark,size,iterations,ns_per_op,bytes_per_s
+//
+// Frame header encoding, masking, UTF-8 validation, Sec-WebSocket-Accept and
+// Base64 run on any board. Handshake and echo (framing + parsing through the
+// real network stack) need a loopback interface, so they run only on ESP32
+// with NETWORK_CONTROLLER_WIFI (client and server in this sketch talk over
+// 127.0.0.1). The handshake is also split into the time spent in
+// server.listen() and in the client (handshake_server, handshake_client).
+// Burst sends kBurstSize small messages at once and waits for all echoes,
+// with some other work in every loop iteration (ns_per_op is the latency of
+// the whole burst). It runs with one frame per listen() call (burst_cap1) and
+// with up to 8 (burst_cap8), on both ends.
+//
+// Frame parsing alone (server side: header, unmasking, dispatch) runs with
+// NETWORK_CONTROLLER_SIMULATED, frames are fed from memory, so no network
+// stack is measured (only the listen() call around parsing).
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_SAMD21
+#  define _SERIAL SerialUSB
+#else
+#  define _SERIAL Serial
+#endif
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_AVR
+constexpr uint16_t kSizes[]{16, 64, 125};
+#else
+constexpr uint16_t kSizes[]{16, 125, 1024};
+#endif
+constexpr uint16_t kMaxSize{kSizes[sizeof(kSizes) / sizeof(kSizes[0]) - 1]};
+
+/** Each benchmark runs for (at least) that long, in milliseconds. */
+constexpr uint32_t kMinDuration{500};
+
+char payload[kMaxSize]{};
+char output[kMaxSize * 4 / 3 + 4]{};
+volatile uint32_t sink{0}; // Keeps the compiler from dropping the work
+
+using benchmarkFunction = void (*)(uint16_t size);
+
+/** @param elapsed Time of all iterations (in microseconds). */
+void report(const __FlashStringHelper *name, uint16_t size,
+  uint32_t iterations, uint32_t elapsed) {
+  _SERIAL.print(name);
+  _SERIAL.print(',');
+  _SERIAL.print(size);
+  _SERIAL.print(',');
+  _SERIAL.print(iterations);
+  _SERIAL.print(',');
+  _SERIAL.print(elapsed * 1000.0 / iterations, 1);
+  _SERIAL.print(',');
+  _SERIAL.println(size * 1e6 * iterations / elapsed, 0);
+}
+/** @return Number of iterations. */
+uint32_t run(const __FlashStringHelper *name, uint16_t size,
+  benchmarkFunction function) {
+  uint32_t iterations{0};
+  const uint32_t startTime{micros()};
+  uint32_t elapsed{0};
+  do {
+    function(size);
+    ++iterations;
+    elapsed = micros() - startTime;
+  } while (elapsed < kMinDuration * 1000);
+
+  report(name, size, iterations, elapsed);
+  return iterations;
+}
+void runAll(const __FlashStringHelper *name, benchmarkFunction function) {
+  for (auto size : kSizes)
+    run(name, size, function);
+}
+
+void frameHeader(uint16_t size) {
+  const char maskingKey[4]{0x12, 0x34, 0x56, 0x78};
+  sink += encodeFrameHeader(
+    output, WebSocket::TEXT_FRAME, true, size, maskingKey);
+}
+void mask(uint16_t size) {
+  const char maskingKey[4]{0x12, 0x34, 0x56, 0x78};
+  applyMask(payload, size, maskingKey);
+  sink += payload[0];
+}
+void utf8(uint16_t size) {
+  sink += isValidUTF8(reinterpret_cast<const byte *>(payload), size);
+}
+void secKey(uint16_t) {
+  encodeSecKey("dGhlIHNhbXBsZSBub25jZQ==", output);
+  sink += output[0];
+}
+void base64(uint16_t size) { sink += base64_encode(output, payload, size); }
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32 &&                           \
+  NETWORK_CONTROLLER == NETWORK_CONTROLLER_WIFI
+constexpr uint16_t kPort{3000};
+
+// A few slots, the previous connection might not be cleaned up yet
+BasicWebSocketServer<4, kMaxSize + 1> server{kPort};
+BasicWebSocketClient<kMaxSize + 1> client;
+volatile bool received{false};
+volatile uint16_t echoes{0};
+uint16_t expectedEchoes{1};
+
+constexpr uint16_t kBurstSize{16};
+/** Time spent elsewhere in each loop iteration (in microseconds). */
+constexpr uint16_t kLoopWork{500};
+
+/** Time spent in server.listen() and in the client (in microseconds). */
+uint32_t serverTime{0};
+uint32_t clientTime{0};
+
+void pump(volatile bool &done, uint16_t loopWork = 0) {
+  const uint32_t startTime{millis()};
+  while (!done && millis() - startTime < kTimeoutInterval) {
+    const uint32_t serverStart{micros()};
+    server.listen();
+    const uint32_t clientStart{micros()};
+    serverTime += clientStart - serverStart;
+    client.listen();
+    clientTime += micros() - clientStart;
+    if (loopWork) delayMicroseconds(loopWork);
+  }
+}
+void handshake(uint16_t) {
+  client.terminate();
+  server.listen(); // Removes the previous connection
+
+  received = false;
+  const uint32_t clientStart{micros()};
+  client.openAsync("127.0.0.1", kPort); // Connects and sends the request
+  clientTime += micros() - clientStart;
+  pump(received); // Set by onOpen
+}
+void echo(uint16_t size) {
+  received = false;
+  echoes = 0;
+  client.send(WebSocket::DataType::BINARY, payload, size);
+  pump(received); // Set by onMessage
+}
+void setFramesPerListen(uint8_t count) {
+  WebSocketServer::ListenPolicy policy;
+  policy.framesPerClient = count;
+  server.setListenPolicy(policy);
+  client.setMaxFramesPerListen(count);
+}
+void burst(uint16_t size) {
+  received = false;
+  echoes = 0;
+  expectedEchoes = kBurstSize;
+  for (uint16_t i = 0; i < kBurstSize; ++i)
+    client.send(WebSocket::DataType::BINARY, payload, size);
+  pump(received, kLoopWork);
+  expectedEchoes = 1;
+}
+#elif NETWORK_CONTROLLER == NETWORK_CONTROLLER_SIMULATED
+constexpr uint16_t kPort{3000};
+
+BasicWebSocketServer<1, kMaxSize + 1> server{kPort};
+SimClient feeder; // Raw client end, writes frames straight into memory
+char frame[kMaxFrameHeaderSize + kMaxSize]{};
+
+bool connectFeeder() {
+  WebSocketServer::ListenPolicy policy;
+  policy.framesPerClient = 0; // Every frame fed goes in one listen()
+  server.setListenPolicy(policy);
+  server.onConnection([](WebSocket &ws) {
+    ws.onMessage([](WebSocket &, const WebSocket::DataType, const char *,
+                   uint16_t length) { sink += length; });
+  });
+  server.begin();
+
+  if (!feeder.connect("127.0.0.1", kPort)) return false;
+  feeder.print(F("GET / HTTP/1.1\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n"));
+  server.listen();
+  while (feeder.read() != -1) // Response
+    ;
+  return server.countClients() == 1;
+}
+void parse(uint16_t size) {
+  const char maskingKey[4]{0x12, 0x34, 0x56, 0x78};
+  const auto headerSize = encodeFrameHeader(
+    frame, WebSocket::BINARY_FRAME, true, size, maskingKey);
+  memcpy(&frame[headerSize], payload, size);
+  applyMask(&frame[headerSize], size, maskingKey);
+  const uint16_t frameSize = headerSize + size;
+  // As many as the receive buffer holds
+  const uint16_t batch = frameSize < kSimBufferSize ? kSimBufferSize / frameSize
+                                                    : 1;
+
+  uint32_t iterations{0};
+  uint32_t elapsed{0};
+  do {
+    for (uint16_t i = 0; i < batch; ++i)
+      feeder.write(reinterpret_cast<const uint8_t *>(frame), frameSize);
+
+    const uint32_t startTime{micros()};
+    server.listen();
+    elapsed += micros() - startTime;
+    iterations += batch;
+  } while (elapsed < kMinDuration * 1000);
+
+  report(F("parse"), size, iterations, elapsed);
+}
+#endif
+
+void setup() {
+  _SERIAL.begin(115200);
+  while (!_SERIAL)
+    ;
+
+  // Mostly ASCII with some 2 and 3 byte sequences, as in typical JSON
+  for (uint16_t i = 0; i < kMaxSize; ++i)
+    payload[i] = 'a' + (i % 26);
+  for (uint16_t i = 0; i + 5 < kMaxSize; i += 32) {
+    memcpy(&payload[i], "\xC2\xB5", 2);         // µ
+    memcpy(&payload[i + 2], "\xE2\x82\xAC", 3); // €
+  }
+
+  _SERIAL.println(F("benchmark,size,iterations,ns_per_op,bytes_per_s"));
+
+  runAll(F("frame_header"), frameHeader);
+  runAll(F("utf8"), utf8);
+  runAll(F("mask"), mask); // Scrambles the payload
+  run(F("sec_key"), 24, secKey);
+  runAll(F("base64"), base64);
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32 &&                           \
+  NETWORK_CONTROLLER == NETWORK_CONTROLLER_WIFI
+  WiFi.mode(WIFI_STA); // Brings up the TCP/IP stack (loopback only)
+
+  server.onConnection([](WebSocket &ws) {
+    ws.onMessage([](WebSocket &ws, const WebSocket::DataType dataType,
+                   const char *message, uint16_t length) {
+      ws.send(dataType, message, length);
+    });
+  });
+  server.begin();
+
+  client.onOpen([](WebSocket &) { received = true; });
+  client.onMessage([](WebSocket &, const WebSocket::DataType, const char *,
+                     uint16_t) {
+    if (++echoes >= expectedEchoes) received = true;
+  });
+
+  serverTime = clientTime = 0;
+  const auto handshakes = run(F("handshake"), 0, handshake);
+  report(F("handshake_server"), 0, handshakes, serverTime);
+  report(F("handshake_client"), 0, handshakes, clientTime);
+  runAll(F("echo"), echo);
+  setFramesPerListen(1);
+  run(F("burst_cap1"), 16, burst);
+  setFramesPerListen(8);
+  run(F("burst_cap8"), 16, burst);
+  client.terminate();
+#elif NETWORK_CONTROLLER == NETWORK_CONTROLLER_SIMULATED
+  if (connectFeeder()) {
+    for (auto size : kSizes)
+      parse(size);
+  }
+#endif
+
+  _SERIAL.println(F("done"));
+}
+
+void loop() {}
@@ -0,0 +1,250 @@
+#include <WebSocketClient.h>
+#include <WebSocketServer.h>
+using namespace net;
+
+// Finds out how many messages per second the server sustains and at what
+// latency: for every scenario below, N clients connect to the server running
+// in this very sketch (over 127.0.0.1, no other device or service involved)
+// and send messages that the server echoes back. One line of CSV per scenario:
+//
+//   clients,size,rate,sent,messages,errors,msg_per_s,bytes_per_s,p50_us,
+//   p99_us,p999_us,max_us
+//
+// Clients send on a fixed schedule (open loop): rate is the number of
+// messages per second of all clients together, sent no matter how many
+// echoes are still outstanding. Latency is measured from the time a message
+// was due, not from when it actually went out, so a server that falls
+// behind shows up in the percentiles instead of quietly lowering the send
+// rate (coordinated omission). messages counts the echoes received within
+// the scenario, errors the messages that could not be sent or were never
+// echoed. send() never fragments, every message is a single frame.
+//
+// The server runs in its own task on core 0 and the clients in the loop task
+// on core 1, so they don't take turns in one loop. They still share the chip
+// (memory, TCP/IP stack and WiFi task on core 0), so results are a lower
+// bound of what the server does with clients on other devices.
+
+#if PLATFORM_ARCH != PLATFORM_ARCHITECTURE_ESP32 ||                           \
+  NETWORK_CONTROLLER != NETWORK_CONTROLLER_WIFI
+#  error "Loopback requires ESP32 with NETWORK_CONTROLLER_WIFI"
+#endif
+
+struct Scenario {
+  uint8_t clients;
+  uint16_t size;
+  uint16_t rate;
+};
+constexpr Scenario kScenarios[]{
+  {1, 16, 1000},
+  {4, 16, 2000},
+  {8, 16, 4000},
+  {4, 125, 200},
+  {4, 125, 1000},
+  {8, 1024, 200},
+};
+
+constexpr uint8_t kMaxClients{8};
+constexpr uint16_t kMaxSize{1024};
+/** Duration of a single scenario (in milliseconds). */
+constexpr uint32_t kDuration{10000};
+/** Latency samples kept per scenario (reservoir sampling beyond that). */
+constexpr uint16_t kMaxSamples{4096};
+/** Overdue messages a client sends in one pass (catching up on schedule). */
+constexpr uint8_t kMaxCatchUp{4};
+
+constexpr uint16_t kPort{3000};
+
+BasicWebSocketServer<kMaxClients, kMaxSize + 1> server{kPort};
+
+/// Updated by the server task, countClients() must not be called elsewhere
+volatile uint8_t serverClients{0};
+
+struct Connection {
+  BasicWebSocketClient<kMaxSize + 1> client;
+  /// micros() the next message is due
+  uint32_t nextSend{0};
+};
+Connection connections[kMaxClients];
+
+/// The first 4 bytes carry the due time of the message (echoed back)
+char payload[kMaxSize]{};
+uint32_t samples[kMaxSamples]{};
+uint32_t sent{0};
+uint32_t messages{0};
+uint32_t errors{0};
+
+void recordLatency(uint32_t latency) {
+  if (messages < kMaxSamples) {
+    samples[messages] = latency;
+  } else {
+    const auto i = random(messages + 1);
+    if (i < kMaxSamples) samples[i] = latency;
+  }
+  ++messages;
+}
+
+int compareSamples(const void *a, const void *b) {
+  const auto lhs = *static_cast<const uint32_t *>(a);
+  const auto rhs = *static_cast<const uint32_t *>(b);
+  return lhs < rhs ? -1 : (lhs > rhs ? 1 : 0);
+}
+uint32_t percentile(uint16_t count, uint16_t perMille) {
+  if (count == 0) return 0;
+  return samples[static_cast<uint32_t>(count - 1) * perMille / 1000];
+}
+
+bool isDue(const Connection &connection) {
+  return static_cast<int32_t>(micros() - connection.nextSend) >= 0;
+}
+
+void runServer(void *) {
+  for (;;) {
+    server.listen();
+    serverClients = server.countClients();
+  }
+}
+
+void pump() {
+  for (auto &connection : connections)
+    connection.client.listen();
+}
+
+bool connectClients(uint8_t count) {
+  for (uint8_t i = 0; i < count; ++i)
+    connections[i].client.openAsync("127.0.0.1", kPort);
+
+  const uint32_t startTime{millis()};
+  while (millis() - startTime < kTimeoutInterval) {
+    pump();
+
+    uint8_t open{0};
+    for (uint8_t i = 0; i < count; ++i)
+      if (connections[i].client.getReadyState() == WebSocket::ReadyState::OPEN)
+        ++open;
+    if (open == count) return true;
+  }
+
+  return false;
+}
+void disconnectClients() {
+  for (auto &connection : connections)
+    connection.client.close(WebSocket::NORMAL_CLOSURE, true);
+
+  const uint32_t startTime{millis()};
+  while (serverClients > 0 && millis() - startTime < kTimeoutInterval)
+    delay(1);
+}
+
+void runScenario(const Scenario &scenario) {
+  sent = 0;
+  messages = 0;
+  errors = 0;
+
+  if (!connectClients(scenario.clients)) {
+    Serial.println(F("# Could not connect all clients"));
+    disconnectClients();
+    return;
+  }
+
+  // Each client gets an equal share of the rate
+  const uint32_t interval = 1000000UL * scenario.clients / scenario.rate;
+
+  const uint32_t startTime{micros()};
+  for (uint8_t i = 0; i < scenario.clients; ++i)
+    connections[i].nextSend = startTime + (interval / scenario.clients) * i;
+
+  while (micros() - startTime < kDuration * 1000) {
+    for (uint8_t i = 0; i < scenario.clients; ++i) {
+      auto &connection = connections[i];
+      for (uint8_t n = 0; n < kMaxCatchUp && isDue(connection); ++n) {
+        memcpy(payload, &connection.nextSend, sizeof(uint32_t));
+        if (connection.client.send(
+              WebSocket::DataType::BINARY, payload, scenario.size))
+          ++sent;
+        else
+          ++errors;
+        connection.nextSend += interval;
+      }
+    }
+    pump();
+  }
+  const uint32_t elapsed{micros() - startTime};
+  const uint32_t delivered{messages};
+
+  // Echoes still on the way count for latency, not for throughput
+  const uint32_t drainStart{millis()};
+  while (messages < sent && millis() - drainStart < kTimeoutInterval)
+    pump();
+  errors += sent - messages;
+
+  disconnectClients();
+
+  const uint16_t count = messages < kMaxSamples ? messages : kMaxSamples;
+  qsort(samples, count, sizeof(samples[0]), compareSamples);
+
+  Serial.print(scenario.clients);
+  Serial.print(',');
+  Serial.print(scenario.size);
+  Serial.print(',');
+  Serial.print(scenario.rate);
+  Serial.print(',');
+  Serial.print(sent);
+  Serial.print(',');
+  Serial.print(delivered);
+  Serial.print(',');
+  Serial.print(errors);
+  Serial.print(',');
+  Serial.print(delivered * 1e6 / elapsed, 1);
+  Serial.print(',');
+  Serial.print(delivered * 1e6 * scenario.size / elapsed, 0);
+  Serial.print(',');
+  Serial.print(percentile(count, 500));
+  Serial.print(',');
+  Serial.print(percentile(count, 990));
+  Serial.print(',');
+  Serial.print(percentile(count, 999));
+  Serial.print(',');
+  Serial.println(count ? samples[count - 1] : 0);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    ;
+
+  WiFi.mode(WIFI_STA); // Brings up the TCP/IP stack (loopback only)
+
+  for (uint16_t i = 0; i < kMaxSize; ++i)
+    payload[i] = static_cast<char>(i);
+
+  server.onConnection([](WebSocket &ws) {
+    ws.onMessage([](WebSocket &ws, const WebSocket::DataType dataType,
+                   const char *message, uint16_t length) {
+      ws.send(dataType, message, length);
+    });
+  });
+  server.begin();
+  // Idle priority: shares core 0 with the idle task, which keeps feeding the
+  // task watchdog
+  xTaskCreatePinnedToCore(
+    runServer, "server", 8192, nullptr, tskIDLE_PRIORITY, nullptr, 0);
+
+  for (auto &connection : connections) {
+    connection.client.onMessage([](WebSocket &, const WebSocket::DataType,
+                                  const char *message, uint16_t length) {
+      if (length < sizeof(uint32_t)) return;
+
+      uint32_t dueTime;
+      memcpy(&dueTime, message, sizeof(dueTime));
+      recordLatency(micros() - dueTime);
+    });
+  }
+
+  Serial.println(F("clients,size,rate,sent,messages,errors,msg_per_s,"
+                   "bytes_per_s,p50_us,p99_us,p999_us,max_us"));
+  for (const auto &scenario : kScenarios)
+    runScenario(scenario);
+  Serial.println(F("done"));
+}
+
+void loop() {}
@@ -0,0 +1,99 @@
+#include <WebSocketServer.h>
+using namespace net;
+
+// Chat server sharded over both cores of ESP32: each shard is a server with
+// its own port, connection table and task pinned to a core, so the two
+// listen() loops run in parallel. Shards never touch each other's
+// connections, a message is published to every shard through its PostQueue
+// and sent by the task owning the connections.
+//
+// Clients pick a shard by port (e.g. round-robin in the app or behind a
+// load balancer): ws://<ip>:3000 or ws://<ip>:3001
+
+#if PLATFORM_ARCH != PLATFORM_ARCHITECTURE_ESP32 ||                           \
+  NETWORK_CONTROLLER != NETWORK_CONTROLLER_WIFI
+#  error "Requires ESP32 with NETWORK_CONTROLLER_WIFI"
+#endif
+
+constexpr char kSSID[]{"SKYNET"};
+constexpr char kPassword[]{"***"};
+
+constexpr uint8_t kShardCount{2};
+constexpr uint16_t kBasePort{3000};
+constexpr uint16_t kMaxLength{128};
+
+struct Shard {
+  Shard(uint16_t port) : server{port} {}
+
+  BasicWebSocketServer<8, kMaxLength + 1> server;
+  BasicPostQueue<32, kMaxLength> queue;
+  TaskHandle_t task{nullptr};
+};
+Shard shards[kShardCount]{{kBasePort}, {kBasePort + 1}};
+
+/** @brief Sends a message to the clients of every shard, from any task. */
+void publish(const char *message, uint16_t length) {
+  for (auto &shard : shards) {
+    if (!shard.queue.post(WebSocket::DataType::TEXT, message, length))
+      Serial.println(F("Shard queue full, message dropped"));
+  }
+}
+
+void runShard(void *context) {
+  auto &shard = *static_cast<Shard *>(context);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // Started by setup()
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, 1); // Woken up by a post (or after a tick)
+    shard.server.listen();
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    ;
+
+  Serial.print(F("\nConnecting to "));
+  Serial.println(kSSID);
+  WiFi.begin(kSSID, kPassword);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(500);
+    Serial.print(F("."));
+  }
+  Serial.println(F(" connected"));
+
+  for (uint8_t i = 0; i < kShardCount; ++i) {
+    auto &shard = shards[i];
+
+    // Callbacks run in the task of the shard
+    shard.server.onConnection([](WebSocket &ws) {
+      ws.onMessage([](WebSocket &, const WebSocket::DataType dataType,
+                     const char *message, uint16_t length) {
+        if (dataType == WebSocket::DataType::TEXT) publish(message, length);
+      });
+    });
+    shard.queue.onPost([](void *context) {
+      const auto task = static_cast<Shard *>(context)->task;
+      if (task) xTaskNotifyGive(task);
+    }, &shard);
+    shard.server.setPostQueue(&shard.queue);
+
+    xTaskCreatePinnedToCore(runShard, "shard", 8192, &shard, 1, &shard.task,
+      i % portNUM_PROCESSORS);
+  }
+
+  // Every task handle is set and every server listening before any shard
+  // runs (a message on one shard wakes up all the others)
+  for (uint8_t i = 0; i < kShardCount; ++i) {
+    shards[i].server.begin();
+
+    Serial.print(F("Shard running at "));
+    Serial.print(WiFi.localIP());
+    Serial.print(F(":"));
+    Serial.println(kBasePort + i);
+  }
+  for (auto &shard : shards)
+    xTaskNotifyGive(shard.task);
+}
+
+void loop() { vTaskDelete(nullptr); }
@@ -0,0 +1,123 @@
+#include <WebSocketClient.h>
+#include <WebSocketServer.h>
+using namespace net;
+
+// Measures how many messages per second producer tasks get through a
+// PostQueue: N tasks on core 0 post counters as fast as they can, the network
+// task on core 1 sleeps until woken up by onPost, drains the queue with
+// server.listen() and a client (over 127.0.0.1) counts what arrives. One
+// line of CSV per number of producers:
+//
+//   producers,size,posted,delivered,rejected,msg_per_s
+
+#if PLATFORM_ARCH != PLATFORM_ARCHITECTURE_ESP32 ||                           \
+  NETWORK_CONTROLLER != NETWORK_CONTROLLER_WIFI
+#  error "Loopback requires ESP32 with NETWORK_CONTROLLER_WIFI"
+#endif
+
+constexpr uint8_t kProducerCounts[]{1, 2, 4};
+constexpr uint8_t kMaxProducers{4};
+constexpr uint16_t kSize{16};
+/** Duration of a single run (in milliseconds). */
+constexpr uint32_t kDuration{5000};
+
+constexpr uint16_t kPort{3000};
+
+WebSocketServer server{kPort};
+WebSocketClient client;
+BasicPostQueue<64, kSize> queue;
+
+TaskHandle_t networkTask{nullptr};
+volatile bool running{false};
+volatile uint32_t posted[kMaxProducers]{};
+volatile uint32_t delivered{0};
+
+// Runs at idle priority and sleeps a tick whenever the queue is full, so the
+// idle task of core 0 still gets its turn (and feeds the watchdog)
+void producer(void *index) {
+  const auto i = reinterpret_cast<uintptr_t>(index);
+  char message[kSize]{};
+  while (running) {
+    const uint32_t sequence{posted[i]};
+    memcpy(message, &sequence, sizeof(sequence));
+    if (queue.post(WebSocket::DataType::BINARY, message, kSize))
+      ++posted[i];
+    else
+      vTaskDelay(1); // Full, let the network task catch up
+  }
+  vTaskDelete(nullptr);
+}
+
+void pump() {
+  server.listen();
+  client.listen();
+}
+
+void run(uint8_t producers) {
+  delivered = 0;
+  for (auto &count : posted)
+    count = 0;
+  const uint32_t rejected{queue.countDropped()};
+
+  running = true;
+  for (uintptr_t i = 0; i < producers; ++i)
+    xTaskCreatePinnedToCore(producer, "producer", 2048,
+      reinterpret_cast<void *>(i), tskIDLE_PRIORITY, nullptr, 0);
+
+  const uint32_t startTime{millis()};
+  while (millis() - startTime < kDuration) {
+    ulTaskNotifyTake(pdTRUE, 1); // Woken up by onPost (or after a tick)
+    pump();
+  }
+  running = false;
+  delay(10); // Producers finish their last post
+  for (uint8_t i = 0; i < 100; ++i)
+    pump();
+
+  uint32_t total{0};
+  for (uint8_t i = 0; i < producers; ++i)
+    total += posted[i];
+
+  Serial.print(producers);
+  Serial.print(',');
+  Serial.print(kSize);
+  Serial.print(',');
+  Serial.print(total);
+  Serial.print(',');
+  Serial.print(delivered);
+  Serial.print(',');
+  Serial.print(queue.countDropped() - rejected);
+  Serial.print(',');
+  Serial.println(delivered * 1000.0 / kDuration, 1);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial)
+    ;
+
+  WiFi.mode(WIFI_STA); // Brings up the TCP/IP stack (loopback only)
+
+  networkTask = xTaskGetCurrentTaskHandle();
+  queue.onPost([](void *task) {
+    xTaskNotifyGive(static_cast<TaskHandle_t>(task));
+  }, networkTask);
+
+  server.setPostQueue(&queue);
+  server.begin();
+
+  client.onMessage([](WebSocket &, const WebSocket::DataType, const char *,
+                     uint16_t) { ++delivered; });
+  client.openAsync("127.0.0.1", kPort);
+  const uint32_t startTime{millis()};
+  while (client.getReadyState() != WebSocket::ReadyState::OPEN &&
+         millis() - startTime < kTimeoutInterval)
+    pump();
+
+  Serial.println(F("producers,size,posted,delivered,rejected,msg_per_s"));
+  for (auto producers : kProducerCounts)
+    run(producers);
+  Serial.println(F("done"));
+}
+
+void loop() {}
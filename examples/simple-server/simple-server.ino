@@ -18,6 +18,9 @@ IPAddress ip(192, 168, 46, 180);
 constexpr uint16_t port = 3000;
 WebSocketServer wss{port};
 
+// Subprotocols the server accepts (see ws.getProtocol())
+const char *const kProtocols[]{"chat", "superchat"};
+
 void setup() {
   _SERIAL.begin(115200);
   while (!_SERIAL)
@@ -92,6 +95,7 @@ void setup() {
     ws.send(WebSocket::DataType::TEXT, message, strlen(message));
   });
 
+  wss.setProtocols(kProtocols, 2);
   wss.begin();
 }
 
@@ -0,0 +1,147 @@
+#include <WebSocketClient.h>
+#include <WebSocketServer.h>
+using namespace net;
+
+// Handshake scenarios on the simulated network (build with
+// NETWORK_CONTROLLER_SIMULATED, see config.h), every run prints the same:
+//
+//   scenario,result,expected,status
+//
+// segmented: the request arrives in 16 byte segments 2 ms apart, listen()
+// must return at once (virtual clock unchanged) until it is complete.
+// stalled: a client sends half a request and goes silent, the server keeps
+// echoing another client meanwhile and answers the stalled one with 400
+// after kTimeoutInterval.
+
+#if NETWORK_CONTROLLER != NETWORK_CONTROLLER_SIMULATED
+#  error "Set NETWORK_CONTROLLER to NETWORK_CONTROLLER_SIMULATED (config.h)"
+#endif
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_SAMD21
+#  define _SERIAL SerialUSB
+#else
+#  define _SERIAL Serial
+#endif
+
+constexpr uint16_t kPort{3000};
+/** Virtual time between two loop iterations (in microseconds). */
+constexpr uint32_t kTick{1000};
+
+uint8_t failures{0};
+
+void report(const __FlashStringHelper *scenario, uint32_t result,
+  uint32_t expected) {
+  _SERIAL.print(scenario);
+  _SERIAL.print(',');
+  _SERIAL.print(result);
+  _SERIAL.print(',');
+  _SERIAL.print(expected);
+  _SERIAL.print(',');
+  if (result == expected) {
+    _SERIAL.println(F("ok"));
+  } else {
+    _SERIAL.println(F("FAIL"));
+    ++failures;
+  }
+}
+
+void segmented() {
+  SimNetwork::reset();
+  SimLink link;
+  link.segmentSize = 16;
+  link.bandwidth = 8000; // A segment per 2 ms
+  SimNetwork::setDefaultLink(link);
+
+  WebSocketServer server{kPort};
+  server.begin();
+  WebSocketClient client;
+  client.openAsync("localhost", kPort);
+
+  uint32_t blocked{0}; // server.listen() calls that moved the clock
+  uint32_t calls{0};
+  while (client.getReadyState() != WebSocket::ReadyState::OPEN &&
+         calls < 1000) {
+    const uint32_t before{SimNetwork::micros()};
+    server.listen();
+    if (SimNetwork::micros() != before) ++blocked;
+    ++calls;
+    client.listen();
+    SimNetwork::advance(kTick);
+  }
+  report(F("segmented_open"),
+    client.getReadyState() == WebSocket::ReadyState::OPEN, 1);
+  report(F("segmented_blocking_listens"), blocked, 0);
+
+  client.terminate();
+  SimNetwork::setDefaultLink(SimLink{});
+}
+
+void stalled() {
+  SimNetwork::reset();
+
+  WebSocketServer server{kPort};
+  server.begin();
+  server.onConnection([](WebSocket &ws) {
+    ws.onMessage([](WebSocket &ws, const WebSocket::DataType dataType,
+                   const char *message, uint16_t length) {
+      ws.send(dataType, message, length);
+    });
+  });
+
+  SimClient slowpoke;
+  slowpoke.connect("localhost", kPort);
+  const char kHalf[]{"GET / HTTP/1.1\r\nUpgrade: websocket\r\n"};
+  slowpoke.write(reinterpret_cast<const uint8_t *>(kHalf), sizeof(kHalf) - 1);
+
+  static uint32_t echoes{0};
+  WebSocketClient client;
+  client.onMessage([](WebSocket &, const WebSocket::DataType, const char *,
+                     uint16_t) { ++echoes; });
+  client.openAsync("localhost", kPort);
+
+  char response[16]{};
+  uint8_t length{0};
+  uint32_t rejectedAt{0};
+  uint32_t echoesBefore{0}; // Echoes received until the rejection
+  echoes = 0;
+  // Until the timeout has passed, a message per 10 ms
+  for (uint32_t i = 0; i < kTimeoutInterval + 100; ++i) {
+    server.listen();
+    client.listen();
+    if (i % 10 == 0 && client.getReadyState() == WebSocket::ReadyState::OPEN)
+      client.send(WebSocket::DataType::TEXT, "tick", 4);
+
+    int c;
+    while ((c = slowpoke.read()) != -1)
+      if (length < sizeof(response) - 1) response[length++] = c;
+    if (length && !rejectedAt) {
+      rejectedAt = SimNetwork::millis();
+      echoesBefore = echoes;
+    }
+
+    SimNetwork::advance(kTick);
+  }
+  // Echoes kept coming while the request was pending (~one per 10 ms)
+  report(F("stalled_echoes_while_pending"),
+    echoesBefore >= kTimeoutInterval / 10 - 10, 1);
+  report(F("stalled_rejected_400"), strncmp(response, "HTTP/1.1 400", 12) == 0,
+    1);
+  report(F("stalled_rejected_after_timeout"), rejectedAt >= kTimeoutInterval,
+    1);
+
+  client.terminate();
+}
+
+void setup() {
+  _SERIAL.begin(115200);
+  while (!_SERIAL)
+    ;
+
+  _SERIAL.println(F("scenario,result,expected,status"));
+  segmented();
+  stalled();
+  _SERIAL.print(F("failures,"));
+  _SERIAL.println(failures);
+}
+
+void loop() {}
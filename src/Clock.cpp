@@ -0,0 +1,25 @@
+#include "Clock.h"
+#include "platform.h"
+
+namespace net {
+
+#if NETWORK_CONTROLLER == NETWORK_CONTROLLER_SIMULATED
+static const Clock kDefaultClock{SimNetwork::millis, SimNetwork::micros,
+  SimNetwork::delay};
+#else
+static const Clock kDefaultClock{
+  []() -> uint32_t { return ::millis(); },
+  []() -> uint32_t { return ::micros(); },
+  [](uint32_t ms) { ::delay(ms); },
+};
+#endif
+
+static const Clock *g_clock{&kDefaultClock};
+
+void setClock(const Clock *clock) { g_clock = clock ? clock : &kDefaultClock; }
+
+uint32_t clockMillis() { return g_clock->millis(); }
+uint32_t clockMicros() { return g_clock->micros(); }
+void clockDelay(uint32_t ms) { g_clock->delay(ms); }
+
+} // namespace net
@@ -0,0 +1,34 @@
+#pragma once
+
+/** @file */
+
+#include <stdint.h>
+
+namespace net {
+
+/**
+ * @brief Time source of the library, every timeout and measurement goes
+ * through it.
+ * @see setClock()
+ */
+struct Clock {
+  uint32_t (*millis)();
+  uint32_t (*micros)();
+  void (*delay)(uint32_t ms);
+};
+
+/**
+ * @brief Replaces the time source, e.g. with a virtual clock in tests.
+ * @param clock Has to outlive the library objects, nullptr restores the
+ * default one: Arduino millis()/micros()/delay(), or SimNetwork clock with
+ * NETWORK_CONTROLLER_SIMULATED.
+ */
+void setClock(const Clock *clock);
+
+/** @cond */
+uint32_t clockMillis();
+uint32_t clockMicros();
+void clockDelay(uint32_t ms);
+/** @endcond */
+
+} // namespace net
@@ -0,0 +1,138 @@
+#include "Coroutine.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+namespace net {
+
+CoroutineScheduler::Waiter CoroutineScheduler::s_waiters[kMaxCoroutineWaiters];
+
+void CoroutineScheduler::run() {
+  for (auto &waiter : s_waiters) {
+    switch (waiter.what) {
+    case WaitFor::OPEN:
+      if (!waiter.ws ||
+          waiter.ws->getReadyState() != WebSocket::ReadyState::CONNECTING)
+        _resume(waiter);
+      break;
+    case WaitFor::MESSAGE:
+      // Queued messages go first, then the close
+      if (waiter.queue || !waiter.ws ||
+          waiter.ws->getReadyState() == WebSocket::ReadyState::CLOSED)
+        _resumeWithMessage(waiter);
+      break;
+    case WaitFor::DELAY:
+      if (clockMillis() - waiter.startTime >= waiter.duration)
+        _resume(waiter);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool CoroutineScheduler::_wait(const Waiter &waiter) {
+  for (auto &it : s_waiters) {
+    if (it.what == WaitFor::NOTHING) {
+      if (waiter.what == WaitFor::MESSAGE) {
+        // Another coroutine might have taken the callback already
+        const auto other = _findMessageWaiter(waiter.ws);
+        it = waiter;
+        it.previous = other ? other->previous : waiter.ws->getOnMessage();
+        waiter.ws->onMessage(_onMessage);
+      } else {
+        it = waiter;
+      }
+      WebSocket::setDestroyHook(_forget);
+      return true;
+    }
+  }
+
+  __debugOutput(F("Too many waiting coroutines (kMaxCoroutineWaiters)\n"));
+  return false;
+}
+
+//
+// Private:
+//
+
+void CoroutineScheduler::_onMessage(WebSocket &ws,
+  const WebSocket::DataType dataType, const char *message, uint16_t length) {
+  // Called from listen(), the coroutine is resumed by run() (it may close or
+  // reopen the endpoint, which must not happen in the middle of a frame)
+  const auto waiter = _findMessageWaiter(&ws);
+  if (!waiter) return;
+
+  uint8_t count{0};
+  auto last = &waiter->queue;
+  for (; *last; last = &(*last)->next)
+    ++count;
+  if (count == kMaxQueuedMessages) {
+    __debugOutput(F("Message dropped, coroutine is too slow\n"));
+    return;
+  }
+
+  const auto copy = new QueuedMessage{nullptr, dataType, length,
+    new char[length + 1]};
+  memcpy(copy->data, message, length);
+  copy->data[length] = '\0';
+  *last = copy;
+}
+void CoroutineScheduler::_forget(const WebSocket &ws) {
+  for (auto &waiter : s_waiters)
+    if (waiter.ws == &ws) waiter.ws = nullptr;
+}
+CoroutineScheduler::Waiter *CoroutineScheduler::_findMessageWaiter(
+  const WebSocket *ws) {
+  for (auto &waiter : s_waiters)
+    if (waiter.what == WaitFor::MESSAGE && waiter.ws == ws) return &waiter;
+
+  return nullptr;
+}
+void CoroutineScheduler::_resume(Waiter &waiter) {
+  // The coroutine might wait again right away, in this very slot
+  const auto handle = waiter.handle;
+  waiter = Waiter{};
+  handle.resume();
+}
+void CoroutineScheduler::_resumeWithMessage(Waiter &waiter) {
+  const auto ws = waiter.ws;
+  const auto message = waiter.queue;
+  const auto rest = message ? message->next : nullptr;
+  if (message) {
+    message->next = nullptr;
+    *waiter.message =
+      ReceivedMessage{message->dataType, message->data, message->length};
+  }
+
+  const auto handle = waiter.handle;
+  const auto previous = waiter.previous;
+  waiter = Waiter{};
+  // Nobody waits right now, the callback is taken again by the next wait
+  if (ws && !_findMessageWaiter(ws)) ws->onMessage(previous);
+  handle.resume();
+
+  // The message was valid until this co_await, the rest goes to the next
+  // one (if the coroutine still waits for the endpoint)
+  _drop(message);
+  const auto next = ws ? _findMessageWaiter(ws) : nullptr;
+  if (next) {
+    auto last = &next->queue;
+    while (*last)
+      last = &(*last)->next;
+    *last = rest;
+  } else {
+    _drop(rest);
+  }
+}
+void CoroutineScheduler::_drop(QueuedMessage *message) {
+  while (message) {
+    const auto next = message->next;
+    delete[] message->data;
+    delete message;
+    message = next;
+  }
+}
+
+} // namespace net
+
+#endif
@@ -0,0 +1,213 @@
+#pragma once
+
+/** @file */
+
+#include "WebSocketClient.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#  include <coroutine>
+
+namespace net {
+
+/** Waiting coroutines at the same time (each co_await takes one). */
+constexpr uint8_t kMaxCoroutineWaiters{16};
+/**
+ * Messages kept for a coroutine until CoroutineScheduler::run() resumes it,
+ * later ones are dropped.
+ */
+constexpr uint8_t kMaxQueuedMessages{8};
+
+/**
+ * @class Coroutine
+ * @brief Return type of a coroutine driven by CoroutineScheduler, starts
+ * right away and frees itself when it returns.
+ * @code{.cpp}
+ * Coroutine session(WebSocketClient &client) {
+ *   if (!co_await connectAsync(client, "192.168.46.4", 3000)) co_return;
+ *   client.send(WebSocket::DataType::TEXT, "hello", 5);
+ *   while (auto message = co_await receiveAsync(client)) {
+ *     // message.data, message.length ...
+ *   }
+ * }
+ * @endcode
+ * @note Requires C++20 (e.g. ESP32 core 3.x).
+ */
+class Coroutine {
+public:
+  /** @cond */
+  struct promise_type {
+    Coroutine get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+  /** @endcond */
+};
+
+/**
+ * @brief Message given by co_await receiveAsync(), false if the connection
+ * closed instead (or if the coroutine could not wait, see overflow).
+ */
+struct ReceivedMessage {
+  WebSocket::DataType dataType{WebSocket::DataType::TEXT};
+  /** Valid until the next co_await, nullptr if there is no message. */
+  const char *data{nullptr};
+  uint16_t length{0};
+  /**
+   * Every waiter slot was taken (kMaxCoroutineWaiters), nothing was awaited
+   * and the connection might still be open.
+   */
+  bool overflow{false};
+
+  explicit operator bool() const { return data != nullptr; }
+};
+
+/**
+ * @brief Result of co_await connectAsync(), true if the connection is open.
+ */
+struct OpenResult {
+  bool open{false};
+  /**
+   * Every waiter slot was taken (kMaxCoroutineWaiters), nothing was awaited
+   * and the connection might still be opening.
+   */
+  bool overflow{false};
+
+  operator bool() const { return open; }
+};
+
+/**
+ * @class CoroutineScheduler
+ * @brief Resumes coroutines whose connection opened (or failed), whose
+ * message arrived, whose connection closed or whose delay passed. Messages
+ * are copied by listen() of the server/client and handed over by run(), so
+ * a coroutine never runs inside listen().
+ */
+class CoroutineScheduler {
+public:
+  /** @note Call this in the main loop, after listen(). */
+  static void run();
+
+  /** @cond */
+  enum class WaitFor : uint8_t { NOTHING, OPEN, MESSAGE, DELAY };
+
+  /// Copy of a message read by listen()
+  struct QueuedMessage {
+    QueuedMessage *next{nullptr};
+    WebSocket::DataType dataType{WebSocket::DataType::TEXT};
+    uint16_t length{0};
+    char *data{nullptr};
+  };
+
+  struct Waiter {
+    WaitFor what{WaitFor::NOTHING};
+    std::coroutine_handle<> handle;
+    /// nullptr once the endpoint is destroyed
+    WebSocket *ws{nullptr};
+    uint32_t startTime{0};
+    uint32_t duration{0};
+    ReceivedMessage *message{nullptr};
+    /// onMessage callback of the endpoint, put back when nobody waits
+    WebSocket::onMessageCallback previous{nullptr};
+    /// Messages waiting for run() (up to kMaxQueuedMessages)
+    QueuedMessage *queue{nullptr};
+  };
+
+  /// @return false if every slot is taken (the coroutine goes on then and
+  /// reports overflow)
+  static bool _wait(const Waiter &);
+  /** @endcond */
+
+private:
+  /** @cond */
+  static void _onMessage(WebSocket &, const WebSocket::DataType,
+    const char *message, uint16_t length);
+  /// Destroy hook of WebSocket, waiters resume on the next run()
+  static void _forget(const WebSocket &);
+  static Waiter *_findMessageWaiter(const WebSocket *);
+  static void _resume(Waiter &);
+  /// Resumes with the first queued message (none if the connection is gone)
+  static void _resumeWithMessage(Waiter &);
+  static void _drop(QueuedMessage *);
+  /** @endcond */
+private:
+  static Waiter s_waiters[kMaxCoroutineWaiters];
+};
+
+/** @cond */
+struct OpenAwaiter {
+  WebSocketClientBase &client;
+  const char *host;
+  uint16_t port;
+  const char *path;
+  bool overflow{false};
+
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    client.openAsync(host, port, path);
+    overflow = !CoroutineScheduler::_wait(
+      {CoroutineScheduler::WaitFor::OPEN, handle, &client});
+    return !overflow;
+  }
+  OpenResult await_resume() const {
+    return {client.getReadyState() == WebSocket::ReadyState::OPEN, overflow};
+  }
+};
+
+struct MessageAwaiter {
+  WebSocket &ws;
+  ReceivedMessage message{};
+
+  // Always waits, messages read along with the close are still queued
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    message.overflow = !CoroutineScheduler::_wait(
+      {CoroutineScheduler::WaitFor::MESSAGE, handle, &ws, 0, 0, &message});
+    return !message.overflow;
+  }
+  ReceivedMessage await_resume() const { return message; }
+};
+
+struct DelayAwaiter {
+  uint32_t duration;
+  bool overflow{false};
+
+  bool await_ready() const { return duration == 0; }
+  bool await_suspend(std::coroutine_handle<> handle) {
+    overflow = !CoroutineScheduler::_wait({CoroutineScheduler::WaitFor::DELAY,
+      handle, nullptr, clockMillis(), duration});
+    return !overflow;
+  }
+  bool await_resume() const { return !overflow; }
+};
+/** @endcond */
+
+/**
+ * @brief Opens the connection (see WebSocketClientBase::openAsync()).
+ * @return Awaitable, OpenResult: true once the connection is open, false if
+ * it failed (or with overflow set, if the coroutine could not wait).
+ */
+inline OpenAwaiter connectAsync(WebSocketClientBase &client, const char *host,
+  uint16_t port = 3000, const char *path = "/") {
+  return {client, host, port, path};
+}
+/**
+ * @brief Waits for the next message of the endpoint.
+ * @return Awaitable, ReceivedMessage (false if the connection closed).
+ * @note Takes over the onMessage callback of the endpoint while a coroutine
+ * waits, the one set before gets messages again in between and after.
+ * Messages read by a single listen() are queued (up to kMaxQueuedMessages)
+ * and handed over one per co_await.
+ */
+inline MessageAwaiter receiveAsync(WebSocket &ws) { return {ws}; }
+/**
+ * @brief Waits for given time (in milliseconds) without blocking.
+ * @return Awaitable, false if the coroutine could not wait (every waiter slot
+ * was taken, see kMaxCoroutineWaiters).
+ */
+inline DelayAwaiter delayAsync(uint32_t duration) { return {duration}; }
+
+} // namespace net
+
+#endif
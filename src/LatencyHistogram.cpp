@@ -0,0 +1,99 @@
+#include "LatencyHistogram.h"
+
+namespace net {
+
+void LatencyHistogram::record(uint32_t duration) {
+  auto &bucket = m_buckets[_bucketIndex(duration)];
+  if (bucket == 0xFFFF) _halve();
+  ++bucket;
+  ++m_count;
+  if (duration > m_max) m_max = duration;
+}
+void LatencyHistogram::reset() {
+  memset(m_buckets, 0, m_bucketCount * sizeof(m_buckets[0]));
+  m_count = 0;
+  m_max = 0;
+}
+
+uint32_t LatencyHistogram::count() const { return m_count; }
+uint32_t LatencyHistogram::getMax() const { return m_max; }
+uint32_t LatencyHistogram::getPercentile(float percentile) const {
+  if (m_count == 0) return 0;
+
+  // Buckets might have been halved, their sum is the total then
+  uint32_t total{0};
+  for (uint16_t i = 0; i < m_bucketCount; ++i)
+    total += m_buckets[i];
+
+  // Rank of the percentile, 1-based
+  auto rank = static_cast<uint32_t>(total * (percentile / 100.0f) + 0.5f);
+  if (rank < 1) rank = 1;
+  if (rank > total) rank = total;
+
+  uint32_t sum{0};
+  for (uint16_t i = 0; i < m_bucketCount; ++i) {
+    sum += m_buckets[i];
+    if (sum >= rank) {
+      if (i == m_bucketCount - 1) return m_max; // Unbounded
+      const auto upperBound = _bucketUpperBound(i);
+      return upperBound < m_max ? upperBound : m_max;
+    }
+  }
+  return m_max;
+}
+
+//
+// Protected:
+//
+
+LatencyHistogram::LatencyHistogram(uint16_t *buckets, uint8_t subBucketBits)
+  : m_buckets{buckets}, m_subBucketBits{subBucketBits},
+    m_bucketCount{_bucketCount(subBucketBits)} {}
+
+//
+// Private:
+//
+
+// With S = 2^subBucketBits: indices below S hold 0 to S-1 us, then each power
+// of two 2^n (n = subBucketBits..kLatencyRangeBits-1) is split into S
+// sub-buckets of 2^(n - subBucketBits) us, the last index holds the rest.
+uint16_t LatencyHistogram::_bucketIndex(uint32_t duration) const {
+  const uint16_t subBuckets{static_cast<uint16_t>(1u << m_subBucketBits)};
+  if (duration < subBuckets) return duration;
+
+  constexpr uint8_t kBits{sizeof(unsigned long) * 8};
+  const uint8_t msb = kBits - 1 - __builtin_clzl(duration);
+  if (msb >= kLatencyRangeBits) return m_bucketCount - 1;
+
+  const uint8_t shift = msb - m_subBucketBits;
+  // Top bits below the leading one
+  const uint16_t subBucket = (duration >> shift) - subBuckets;
+  return subBuckets * (shift + 1) + subBucket;
+}
+uint32_t LatencyHistogram::_bucketUpperBound(uint16_t index) const {
+  const uint16_t subBuckets{static_cast<uint16_t>(1u << m_subBucketBits)};
+  if (index < subBuckets) return index;
+
+  const uint8_t shift = index / subBuckets - 1;
+  const uint32_t lowerBound{
+    static_cast<uint32_t>(subBuckets + index % subBuckets) << shift};
+  return lowerBound + (uint32_t{1} << shift) - 1;
+}
+void LatencyHistogram::_halve() {
+  // Rounded up, a bucket that was hit stays visible
+  for (uint16_t i = 0; i < m_bucketCount; ++i)
+    m_buckets[i] = (m_buckets[i] + 1) / 2;
+}
+
+//
+// LatencyHistograms struct implementation:
+//
+
+void LatencyHistograms::reset() {
+  loop.reset();
+  frame.reset();
+  dispatch.reset();
+  write.reset();
+}
+
+} // namespace net
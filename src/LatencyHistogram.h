@@ -0,0 +1,100 @@
+#pragma once
+
+/** @file */
+
+#include "utility.h"
+
+namespace net {
+
+/**
+ * @class LatencyHistogram
+ * @brief Fixed size histogram of durations (in microseconds) with
+ * logarithmic buckets: each power of two is split into 2^subBucketBits
+ * sub-buckets, so a percentile is off by at most 1/2^subBucketBits (12.5%
+ * with 3 bits). Durations below 2^subBucketBits are exact, those above
+ * ~1 second (kLatencyRangeBits) fall into the last bucket.
+ * @note Counters are 16-bit, when one of them fills up all are halved (the
+ * shape of the distribution, so percentiles, stays the same).
+ * @see BasicLatencyHistogram
+ */
+class LatencyHistogram {
+public:
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  /** @brief Counts a single duration (in microseconds). */
+  void record(uint32_t duration);
+  void reset();
+
+  /** @return Number of recorded durations. */
+  uint32_t count() const;
+  /** @return Longest recorded duration (exact). */
+  uint32_t getMax() const;
+  /**
+   * @param percentile In range 0-100, e.g. 99.9
+   * @return Upper bound of the bucket holding given percentile, 0 if empty.
+   */
+  uint32_t getPercentile(float percentile) const;
+
+protected:
+  /** @param buckets Array of bucketCount(subBucketBits) counters. */
+  LatencyHistogram(uint16_t *buckets, uint8_t subBucketBits);
+
+  /** @cond */
+  static constexpr uint16_t _bucketCount(uint8_t subBucketBits) {
+    return (1u << subBucketBits) * (kLatencyRangeBits - subBucketBits + 1) + 1;
+  }
+  /** @endcond */
+
+private:
+  /** @cond */
+  uint16_t _bucketIndex(uint32_t duration) const;
+  uint32_t _bucketUpperBound(uint16_t index) const;
+  void _halve();
+  /** @endcond */
+private:
+  uint16_t *m_buckets;
+  const uint8_t m_subBucketBits;
+  const uint16_t m_bucketCount;
+  uint32_t m_count{0};
+  uint32_t m_max{0};
+};
+
+/**
+ * @class BasicLatencyHistogram
+ * @brief Histogram with 2^SubBucketBits buckets per power of two, takes
+ * (2^SubBucketBits * (21 - SubBucketBits) + 1) * 2 bytes (290 with 3 bits,
+ * 154 with 2).
+ */
+template <uint8_t SubBucketBits>
+class BasicLatencyHistogram final : public LatencyHistogram {
+  static_assert(SubBucketBits >= 1 && SubBucketBits <= 6,
+    "1 to 6 bits per power of two");
+
+public:
+  BasicLatencyHistogram() : LatencyHistogram{m_buckets, SubBucketBits} {}
+
+private:
+  uint16_t m_buckets[_bucketCount(SubBucketBits)]{};
+};
+
+/**
+ * @brief Histograms recorded by WebSocketServerBase::listen() or
+ * WebSocketClientBase::listen().
+ * @note Available with _LATENCY_HISTOGRAMS defined (see config.h), the
+ * resolution is set by kLatencySubBucketBits.
+ */
+struct LatencyHistograms {
+  /** Whole listen() call. */
+  BasicLatencyHistogram<kLatencySubBucketBits> loop;
+  /** Reading and parsing a frame (without onMessage callback). */
+  BasicLatencyHistogram<kLatencySubBucketBits> frame;
+  /** onMessage callback. */
+  BasicLatencyHistogram<kLatencySubBucketBits> dispatch;
+  /** Writing a frame (send, ping, close, pong). */
+  BasicLatencyHistogram<kLatencySubBucketBits> write;
+
+  void reset();
+};
+
+} // namespace net
@@ -0,0 +1,47 @@
+#include "MessageBufferPool.h"
+
+namespace net {
+
+void MessageBufferPool::setExhaustionPolicy(
+  const ExhaustionPolicy policy, uint16_t waitTimeout) {
+  m_policy = policy;
+  m_waitTimeout = waitTimeout;
+}
+
+uint16_t MessageBufferPool::getBufferSize() const { return m_bufferSize; }
+uint8_t MessageBufferPool::countFree() const {
+  uint8_t count{0};
+  for (uint8_t i = 0; i < m_count; ++i)
+    if (!(m_usedMask & (1u << i))) ++count;
+
+  return count;
+}
+
+//
+// Protected:
+//
+
+MessageBufferPool::MessageBufferPool(
+  char *storage, uint8_t count, uint16_t bufferSize)
+  : m_storage{storage}, m_count{count}, m_bufferSize{bufferSize} {}
+
+//
+// Private:
+//
+
+char *MessageBufferPool::_acquire() {
+  for (uint8_t i = 0; i < m_count; ++i) {
+    if (!(m_usedMask & (1u << i))) {
+      m_usedMask |= (1u << i);
+      return &m_storage[i * m_bufferSize];
+    }
+  }
+
+  return nullptr;
+}
+void MessageBufferPool::_release(char *buffer) {
+  const auto i = static_cast<uint8_t>((buffer - m_storage) / m_bufferSize);
+  m_usedMask &= ~(1u << i);
+}
+
+} // namespace net
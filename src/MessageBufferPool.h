@@ -0,0 +1,86 @@
+#pragma once
+
+/** @file */
+
+#include "utility.h"
+
+namespace net {
+
+/**
+ * @class MessageBufferPool
+ * @brief Message buffers shared by server connections. A connection borrows
+ * one only while it assembles a message that does not fit in its own buffer
+ * and returns it as soon as the message is delivered.
+ * @see BasicMessageBufferPool
+ */
+class MessageBufferPool {
+  friend class WebSocket;
+
+public:
+  /** What a connection does when every buffer is taken. */
+  enum class ExhaustionPolicy : uint8_t {
+    /** Closes the connection with TRY_AGAIN_LATER code. */
+    CLOSE,
+    /**
+     * Leaves the frame payload unread until a buffer is returned, closes the
+     * connection (TRY_AGAIN_LATER) if that takes longer than waitTimeout.
+     */
+    WAIT
+  };
+
+public:
+  MessageBufferPool(const MessageBufferPool &) = delete;
+  MessageBufferPool &operator=(const MessageBufferPool &) = delete;
+
+  /** @param waitTimeout Used by ExhaustionPolicy::WAIT (in milliseconds). */
+  void setExhaustionPolicy(
+    const ExhaustionPolicy, uint16_t waitTimeout = kTimeoutInterval);
+
+  /** @return Size of a single buffer (in bytes). */
+  uint16_t getBufferSize() const;
+  /** @return Number of buffers not borrowed by any connection. */
+  uint8_t countFree() const;
+
+protected:
+  /** @param storage Array of count * bufferSize bytes. */
+  MessageBufferPool(char *storage, uint8_t count, uint16_t bufferSize);
+
+private:
+  /** @cond */
+  /** @return nullptr if every buffer is taken. */
+  char *_acquire();
+  void _release(char *buffer);
+  /** @endcond */
+private:
+  char *m_storage;
+  uint8_t m_count;
+  uint16_t m_bufferSize;
+  /// Bit n set = buffer n borrowed
+  uint16_t m_usedMask{0};
+
+  ExhaustionPolicy m_policy{ExhaustionPolicy::CLOSE};
+  uint16_t m_waitTimeout{kTimeoutInterval};
+};
+
+/**
+ * @class BasicMessageBufferPool
+ * @brief Pool of Count buffers, BufferSize bytes each.
+ * @code{.cpp}
+ * BasicWebSocketServer<8, 32> server{3000}; // small messages only ...
+ * BasicMessageBufferPool<2, 512> pool;      // ... except for two at a time
+ * server.setBufferPool(&pool);
+ * @endcode
+ */
+template <uint8_t Count, uint16_t BufferSize>
+class BasicMessageBufferPool final : public MessageBufferPool {
+  static_assert(Count > 0 && Count <= 16, "Up to 16 buffers per pool");
+
+public:
+  BasicMessageBufferPool()
+    : MessageBufferPool{&m_buffers[0][0], Count, BufferSize} {}
+
+private:
+  char m_buffers[Count][BufferSize]{};
+};
+
+} // namespace net
@@ -0,0 +1,111 @@
+#include "PostQueue.h"
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+
+namespace net {
+
+bool PostQueue::post(
+  const WebSocket::DataType dataType, const char *message, uint16_t length) {
+  return _push(0, dataType, message, length);
+}
+bool PostQueue::post(uint32_t connectionId, const WebSocket::DataType dataType,
+  const char *message, uint16_t length) {
+  // A message without target would go to every client
+  if (connectionId == 0) return false;
+  return _push(connectionId, dataType, message, length);
+}
+bool PostQueue::post(WebSocket &ws, const WebSocket::DataType dataType,
+  const char *message, uint16_t length) {
+  return post(ws.getId(), dataType, message, length);
+}
+
+void PostQueue::onPost(const onPostCallback &callback, void *context) {
+  _onPost = callback;
+  m_postContext = context;
+}
+
+uint16_t PostQueue::getMaxLength() const { return m_maxLength; }
+uint32_t PostQueue::countDropped() const {
+  return m_dropped.load(std::memory_order_relaxed);
+}
+
+//
+// Protected:
+//
+
+PostQueue::PostQueue(
+  char *storage, uint16_t slotSize, uint16_t capacity, uint16_t maxLength)
+  : m_storage{storage}, m_slotSize{slotSize},
+    m_mask{static_cast<uint16_t>(capacity - 1)}, m_maxLength{maxLength} {}
+
+void PostQueue::_reset() {
+  for (uint32_t i = 0; i <= m_mask; ++i)
+    _slot(i).sequence.store(i, std::memory_order_relaxed);
+  m_pushPosition.store(0, std::memory_order_relaxed);
+  m_popPosition = 0;
+}
+
+//
+// Private:
+//
+
+PostQueue::Header &PostQueue::_slot(uint32_t position) const {
+  return *reinterpret_cast<Header *>(
+    &m_storage[(position & m_mask) * m_slotSize]);
+}
+char *PostQueue::_payload(Header *slot) {
+  return reinterpret_cast<char *>(slot + 1);
+}
+const char *PostQueue::_payload(const Header *slot) {
+  return reinterpret_cast<const char *>(slot + 1);
+}
+
+bool PostQueue::_push(uint32_t target, const WebSocket::DataType dataType,
+  const char *message, uint16_t length) {
+  if (length > m_maxLength) return false;
+
+  // Claim a slot: the one at the push position is free when its sequence
+  // equals the position, behind it (full) when it is lower.
+  auto position = m_pushPosition.load(std::memory_order_relaxed);
+  Header *slot{nullptr};
+  for (;;) {
+    slot = &_slot(position);
+    const auto sequence = slot->sequence.load(std::memory_order_acquire);
+    const auto diff = static_cast<int32_t>(sequence - position);
+    if (diff == 0) {
+      if (m_pushPosition.compare_exchange_weak(
+            position, position + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      position = m_pushPosition.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->target = target;
+  slot->dataType = dataType;
+  slot->length = length;
+  memcpy(_payload(slot), message, length);
+  // Publishes the message to the consumer
+  slot->sequence.store(position + 1, std::memory_order_release);
+
+  if (_onPost) _onPost(m_postContext);
+  return true;
+}
+const PostQueue::Header *PostQueue::_front() const {
+  const auto &slot = _slot(m_popPosition);
+  const auto sequence = slot.sequence.load(std::memory_order_acquire);
+  return sequence == m_popPosition + 1 ? &slot : nullptr;
+}
+void PostQueue::_pop() {
+  // Hands the slot back to producers, one lap later
+  _slot(m_popPosition)
+    .sequence.store(m_popPosition + m_mask + 1, std::memory_order_release);
+  ++m_popPosition;
+}
+
+} // namespace net
+
+#endif
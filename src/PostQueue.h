@@ -0,0 +1,165 @@
+#pragma once
+
+/** @file */
+
+#include "WebSocket.h"
+
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+#  include <atomic>
+
+namespace net {
+
+/**
+ * @class PostQueue
+ * @brief Lock-free queue of outgoing messages, lets other tasks (or the other
+ * core) send through a server/client that is driven by listen() in a single
+ * task. Messages are copied, listen() sends them in a batch.
+ * @note Any number of producers, the only consumer is listen().
+ * @see BasicPostQueue
+ */
+class PostQueue {
+  friend class WebSocketServerBase;
+  friend class WebSocketClientBase;
+
+public:
+  /**
+   * @brief Called by the producer after each successful post(), e.g. to wake
+   * up the task calling listen().
+   * @param context Pointer given to onPost().
+   */
+  using onPostCallback = void (*)(void *context);
+
+public:
+  PostQueue(const PostQueue &) = delete;
+  PostQueue &operator=(const PostQueue &) = delete;
+
+  /**
+   * @brief Posts a message to every client of the server (or to the server
+   * the client is connected to). Safe to call from any task.
+   * @return false if the queue is full or the message too long.
+   */
+  bool post(const WebSocket::DataType, const char *message, uint16_t length);
+  /**
+   * @brief Posts a message to a single connection of the server, dropped if
+   * the connection is gone by the time listen() gets to it.
+   * @param connectionId WebSocket::getId() of the connection, ids are never
+   * reused, so a message does not reach a newer connection in the same slot.
+   * @note A client drains such messages without sending them.
+   * @code{.cpp}
+   * // Network task (e.g. in onConnection)
+   * player.connectionId = ws.getId();
+   * // Any task
+   * queue.post(player.connectionId, WebSocket::DataType::TEXT, "go", 2);
+   * @endcode
+   */
+  bool post(uint32_t connectionId, const WebSocket::DataType,
+    const char *message, uint16_t length);
+  /**
+   * @brief Same as above, with the id of the given connection.
+   * @note Reads ws, so the connection has to be alive (e.g. called from
+   * its callbacks), other tasks should keep the id instead.
+   */
+  bool post(WebSocket &ws, const WebSocket::DataType, const char *message,
+    uint16_t length);
+
+  /**
+   * @brief
+   * @code{.cpp}
+   * queue.onPost([](void *task) {
+   *   xTaskNotifyGive(static_cast<TaskHandle_t>(task));
+   * }, xTaskGetCurrentTaskHandle());
+   * @endcode
+   * @note Set it before the producers start.
+   */
+  void onPost(const onPostCallback &callback, void *context = nullptr);
+
+  /** @return Longest message (in bytes). */
+  uint16_t getMaxLength() const;
+  /** @return Number of messages rejected because the queue was full. */
+  uint32_t countDropped() const;
+
+protected:
+  /** @cond */
+  /// Sequence: position the slot is waiting for (Vyukov's bounded queue)
+  struct Header {
+    std::atomic<uint32_t> sequence;
+    /// Connection id, 0 = every client
+    uint32_t target;
+    uint16_t length;
+    WebSocket::DataType dataType;
+  };
+  /** @endcond */
+
+  /**
+   * @param storage Array of capacity slots, each slotSize bytes: a Header
+   * followed by maxLength bytes of payload.
+   * @param capacity Power of two.
+   */
+  PostQueue(
+    char *storage, uint16_t slotSize, uint16_t capacity, uint16_t maxLength);
+
+  /** @brief Marks every slot as free, called by the derived constructor. */
+  void _reset();
+
+private:
+  /** @cond */
+  Header &_slot(uint32_t position) const;
+  /// Message bytes follow the header
+  static char *_payload(Header *);
+  static const char *_payload(const Header *);
+  bool _push(uint32_t target, const WebSocket::DataType,
+    const char *message, uint16_t length);
+  /// @return Oldest message or nullptr if empty, has to be _pop()-ed
+  const Header *_front() const;
+  void _pop();
+  /** @endcond */
+private:
+  char *m_storage;
+  uint16_t m_slotSize;
+  uint16_t m_mask;
+  uint16_t m_maxLength;
+
+  std::atomic<uint32_t> m_pushPosition{0};
+  /// Touched by the consumer only
+  uint32_t m_popPosition{0};
+  std::atomic<uint32_t> m_dropped{0};
+
+  onPostCallback _onPost{nullptr};
+  void *m_postContext{nullptr};
+};
+
+/**
+ * @class BasicPostQueue
+ * @brief Queue of Capacity messages, up to MaxLength bytes each.
+ * @code{.cpp}
+ * BasicPostQueue<16, 64> queue;
+ * server.setPostQueue(&queue);
+ *
+ * // Another task:
+ * queue.post(WebSocket::DataType::TEXT, "t=21.5", 6);
+ * @endcode
+ */
+template <uint16_t Capacity, uint16_t MaxLength>
+class BasicPostQueue final : public PostQueue {
+  static_assert(Capacity > 1 && Capacity <= 32768 &&
+                  (Capacity & (Capacity - 1)) == 0,
+    "Capacity has to be a power of two");
+
+public:
+  BasicPostQueue()
+    : PostQueue{reinterpret_cast<char *>(m_slots), sizeof(Slot), Capacity,
+        MaxLength} {
+    _reset();
+  }
+
+private:
+  struct Slot {
+    Header header;
+    char payload[MaxLength];
+  };
+  Slot m_slots[Capacity];
+};
+
+} // namespace net
+
+#endif
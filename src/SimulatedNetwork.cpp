@@ -0,0 +1,354 @@
+#include "platform.h"
+
+#if NETWORK_CONTROLLER == NETWORK_CONTROLLER_SIMULATED
+
+namespace net {
+
+//
+// Simulated sockets:
+//
+
+namespace {
+
+struct Segment {
+  uint64_t deliverAt;
+  uint16_t length;
+};
+
+struct Socket {
+  bool used;
+  /// Tells a handle to this socket from one to an earlier use of the slot
+  uint16_t generation;
+  /// Closed by its owner (stop) or reset
+  bool closed;
+  int8_t peer;
+  /// Server side of a connection accepted on that port, 0 for client side
+  uint16_t port;
+
+  /// Outgoing direction
+  SimLink link;
+  uint64_t linkFreeAt;
+  uint32_t bytesSent;
+
+  /// Incoming data, both delivered and in flight
+  char data[kSimBufferSize];
+  uint16_t head;
+  uint16_t size;
+  Segment segments[kSimMaxSegments];
+  uint8_t segmentHead;
+  uint8_t segmentCount;
+  /// Bytes of the first segment already read
+  uint16_t segmentOffset;
+};
+
+uint64_t g_now{0};
+uint16_t g_generation{0};
+SimLink g_defaultLink{};
+Socket g_sockets[kSimSocketCount]{};
+SimServer *g_servers[kSimMaxServers]{};
+uint16_t g_serverPorts[kSimMaxServers]{};
+
+Socket *getSocket(int8_t index) {
+  return index >= 0 && g_sockets[index].used ? &g_sockets[index] : nullptr;
+}
+/** @return nullptr if the socket was released (or reset) meanwhile. */
+Socket *getSocket(int8_t index, uint16_t generation) {
+  const auto socket = getSocket(index);
+  return socket && socket->generation == generation ? socket : nullptr;
+}
+int8_t allocateSocket() {
+  for (int8_t i = 0; i < kSimSocketCount; ++i) {
+    if (!g_sockets[i].used) {
+      g_sockets[i] = Socket{};
+      g_sockets[i].used = true;
+      g_sockets[i].generation = ++g_generation;
+      g_sockets[i].link = g_defaultLink;
+      return i;
+    }
+  }
+  return -1;
+}
+void releaseSocket(Socket &socket) {
+  auto peer = getSocket(socket.peer);
+  if (peer) peer->peer = -1;
+  socket.used = false;
+}
+
+/** @return Bytes that already arrived (and were not read yet). */
+uint16_t countDelivered(const Socket &socket) {
+  uint16_t count{0};
+  for (uint8_t i = 0; i < socket.segmentCount; ++i) {
+    const auto &segment =
+      socket.segments[(socket.segmentHead + i) % kSimMaxSegments];
+    if (segment.deliverAt > g_now) break;
+    count += segment.length;
+  }
+  return count - socket.segmentOffset;
+}
+/** @return Delivered bytes of the first segment. */
+uint16_t countReadable(const Socket &socket) {
+  if (socket.segmentCount == 0) return 0;
+
+  const auto &segment = socket.segments[socket.segmentHead];
+  return segment.deliverAt > g_now ? 0 : segment.length - socket.segmentOffset;
+}
+char takeByte(Socket &socket) {
+  const char c{socket.data[socket.head]};
+  socket.head = (socket.head + 1) % kSimBufferSize;
+  --socket.size;
+
+  if (++socket.segmentOffset == socket.segments[socket.segmentHead].length) {
+    socket.segmentHead = (socket.segmentHead + 1) % kSimMaxSegments;
+    --socket.segmentCount;
+    socket.segmentOffset = 0;
+  }
+  return c;
+}
+
+void resetConnection(Socket &socket) {
+  socket.closed = true;
+  socket.size = 0;
+  socket.segmentCount = 0;
+  auto peer = getSocket(socket.peer);
+  if (peer) {
+    peer->closed = true;
+    peer->size = 0;
+    peer->segmentCount = 0;
+  }
+}
+
+/** Puts data into the receiver buffer, to be delivered as given by link. */
+void transmit(Socket &sender, Socket &receiver, const char *data, uint16_t n) {
+  const auto &link = sender.link;
+  const uint16_t segmentSize{link.segmentSize ? link.segmentSize : n};
+
+  for (uint16_t offset = 0; offset < n; offset += segmentSize) {
+    const uint16_t length = n - offset < segmentSize ? n - offset : segmentSize;
+
+    // Segments are transmitted one after another, then travel for latency
+    const uint64_t start{
+      sender.linkFreeAt > g_now ? sender.linkFreeAt : g_now};
+    sender.linkFreeAt =
+      start + (link.bandwidth ? uint64_t{length} * 1000000 / link.bandwidth
+                              : 0);
+    const uint64_t deliverAt{sender.linkFreeAt + link.latency};
+
+    for (uint16_t i = 0; i < length; ++i) {
+      receiver.data[(receiver.head + receiver.size) % kSimBufferSize] =
+        data[offset + i];
+      ++receiver.size;
+    }
+
+    if (receiver.segmentCount == kSimMaxSegments) {
+      // Out of segments, merge with the last one
+      auto &last = receiver.segments[(receiver.segmentHead +
+                                       receiver.segmentCount - 1) %
+                                     kSimMaxSegments];
+      last.length += length;
+      last.deliverAt = deliverAt;
+    } else {
+      auto &segment = receiver.segments[(receiver.segmentHead +
+                                          receiver.segmentCount) %
+                                        kSimMaxSegments];
+      segment = Segment{deliverAt, length};
+      ++receiver.segmentCount;
+    }
+  }
+}
+
+} // namespace
+
+//
+// SimNetwork class implementation:
+//
+
+void SimNetwork::setDefaultLink(const SimLink &link) { g_defaultLink = link; }
+void SimNetwork::advance(uint32_t duration) { g_now += duration; }
+void SimNetwork::reset() {
+  for (auto &socket : g_sockets)
+    socket.used = false;
+  g_now = 0;
+}
+
+uint32_t SimNetwork::millis() { return g_now / 1000; }
+uint32_t SimNetwork::micros() { return g_now; }
+void SimNetwork::delay(uint32_t ms) { g_now += uint64_t{ms} * 1000; }
+
+//
+// SimClient class implementation:
+//
+
+int SimClient::connect(IPAddress, uint16_t port) {
+  return connect(nullptr, port);
+}
+int SimClient::connect(const char *, uint16_t port) {
+  stop();
+
+  SimServer *server{nullptr};
+  for (uint8_t i = 0; i < kSimMaxServers; ++i)
+    if (g_servers[i] && g_serverPorts[i] == port) server = g_servers[i];
+  if (!server) return 0;
+
+  uint8_t connections{0};
+  for (const auto &socket : g_sockets)
+    if (socket.used && !socket.closed && socket.port == port) ++connections;
+  if (connections >= server->m_maxConnections) return 0;
+
+  const auto local = allocateSocket();
+  if (local == -1) return 0;
+  const auto remote = allocateSocket();
+  if (remote == -1) {
+    g_sockets[local].used = false;
+    return 0;
+  }
+
+  g_sockets[local].peer = remote;
+  g_sockets[remote].peer = local;
+  g_sockets[remote].port = port;
+  m_socket = local;
+  m_generation = g_sockets[local].generation;
+
+  // SYN, SYN-ACK
+  g_now += uint64_t{g_defaultLink.latency} * 2;
+  return 1;
+}
+int SimClient::connect(IPAddress ip, uint16_t port, int32_t) {
+  return connect(ip, port);
+}
+int SimClient::connect(const char *host, uint16_t port, int32_t) {
+  return connect(host, port);
+}
+
+size_t SimClient::write(uint8_t c) { return write(&c, 1); }
+size_t SimClient::write(const uint8_t *buffer, size_t size) {
+  auto socket = getSocket(m_socket, m_generation);
+  if (!socket || socket->closed) return 0;
+  auto peer = getSocket(socket->peer);
+  if (!peer || peer->closed) return 0;
+
+  const auto &link = socket->link;
+  g_now += link.writeStall;
+
+  const uint16_t window{
+    link.window < kSimBufferSize ? link.window : kSimBufferSize};
+  const uint16_t space = peer->size < window ? window - peer->size : 0;
+  uint16_t n = size < space ? size : space;
+
+  bool dropped{false};
+  if (link.dropAfter && socket->bytesSent + n >= link.dropAfter) {
+    n = link.dropAfter - socket->bytesSent;
+    dropped = true;
+  }
+
+  transmit(*socket, *peer, reinterpret_cast<const char *>(buffer), n);
+  socket->bytesSent += n;
+  if (dropped) resetConnection(*socket);
+  return n;
+}
+
+int SimClient::available() {
+  auto socket = getSocket(m_socket, m_generation);
+  return socket ? countDelivered(*socket) : 0;
+}
+int SimClient::read() {
+  auto socket = getSocket(m_socket, m_generation);
+  if (!socket || countReadable(*socket) == 0) return -1;
+
+  return static_cast<uint8_t>(takeByte(*socket));
+}
+int SimClient::read(uint8_t *buffer, size_t size) {
+  auto socket = getSocket(m_socket, m_generation);
+  if (!socket) return -1;
+
+  const auto readable = countReadable(*socket);
+  if (readable == 0) return -1;
+
+  const uint16_t n = size < readable ? size : readable;
+  for (uint16_t i = 0; i < n; ++i)
+    buffer[i] = takeByte(*socket);
+  return n;
+}
+int SimClient::peek() {
+  auto socket = getSocket(m_socket, m_generation);
+  if (!socket || countReadable(*socket) == 0) return -1;
+
+  return static_cast<uint8_t>(socket->data[socket->head]);
+}
+void SimClient::flush() {}
+void SimClient::stop() {
+  auto socket = getSocket(m_socket, m_generation);
+  m_socket = -1;
+  if (!socket) return;
+
+  socket->closed = true;
+  auto peer = getSocket(socket->peer);
+  if (!peer || peer->closed) {
+    if (peer) releaseSocket(*peer);
+    releaseSocket(*socket);
+  }
+}
+uint8_t SimClient::connected() {
+  auto socket = getSocket(m_socket, m_generation);
+  if (!socket || socket->closed) return 0;
+
+  // As in Arduino libraries, unread data keeps the client "connected"
+  auto peer = getSocket(socket->peer);
+  return (peer && !peer->closed) || countDelivered(*socket) > 0;
+}
+SimClient::operator bool() { return getSocket(m_socket, m_generation) != nullptr; }
+
+bool SimClient::operator==(const SimClient &other) const {
+  return m_socket == other.m_socket && m_generation == other.m_generation;
+}
+bool SimClient::operator!=(const SimClient &other) const {
+  return !(*this == other);
+}
+
+IPAddress SimClient::remoteIP() { return IPAddress(127, 0, 0, 1); }
+
+void SimClient::setLink(const SimLink &link) {
+  auto socket = getSocket(m_socket, m_generation);
+  if (socket) socket->link = link;
+}
+void SimClient::drop() {
+  auto socket = getSocket(m_socket, m_generation);
+  if (socket) resetConnection(*socket);
+}
+
+SimClient::SimClient(int8_t socket)
+  : m_socket{socket}, m_generation{g_sockets[socket].generation} {}
+
+//
+// SimServer class implementation:
+//
+
+SimServer::SimServer(uint16_t port) : m_port{port} {}
+SimServer::~SimServer() {
+  for (uint8_t i = 0; i < kSimMaxServers; ++i)
+    if (g_servers[i] == this) g_servers[i] = nullptr;
+}
+
+void SimServer::begin() {
+  for (uint8_t i = 0; i < kSimMaxServers; ++i) {
+    if (!g_servers[i] || g_servers[i] == this) {
+      g_servers[i] = this;
+      g_serverPorts[i] = m_port;
+      return;
+    }
+  }
+}
+SimClient SimServer::available() {
+  for (int8_t i = 0; i < kSimSocketCount; ++i) {
+    const auto &socket = g_sockets[i];
+    if (socket.used && !socket.closed && socket.port == m_port &&
+        countDelivered(socket) > 0)
+      return SimClient{i};
+  }
+  return SimClient{};
+}
+
+void SimServer::setMaxConnections(uint8_t count) { m_maxConnections = count; }
+
+} // namespace net
+
+#endif
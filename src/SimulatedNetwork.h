@@ -0,0 +1,147 @@
+#pragma once
+
+/** @file */
+
+#include <Arduino.h>
+#include <Client.h>
+
+namespace net {
+
+/** Receive buffer of a simulated socket (as in W5100 with 4 sockets). */
+constexpr uint16_t kSimBufferSize{2048};
+/** Simulated sockets, both ends of a connection take one. */
+constexpr uint8_t kSimSocketCount{16};
+/** Segments in flight per socket, later writes extend the last one. */
+constexpr uint8_t kSimMaxSegments{32};
+/** Servers listening at the same time. */
+constexpr uint8_t kSimMaxServers{4};
+
+/**
+ * @brief Properties of one direction of a simulated connection (data sent by
+ * the endpoint it is set on).
+ */
+struct SimLink {
+  /** One-way delay (in microseconds). */
+  uint32_t latency{0};
+  /** Bytes per second, 0 = unlimited. */
+  uint32_t bandwidth{0};
+  /**
+   * Writes are split into segments of that size, each arrives on its own and
+   * a read never returns bytes of two segments at once (0 = whole writes).
+   */
+  uint16_t segmentSize{0};
+  /** Unread bytes the receiver buffers, writes beyond that are cut short. */
+  uint16_t window{kSimBufferSize};
+  /** Every write() blocks that long (in microseconds). */
+  uint32_t writeStall{0};
+  /** Connection is reset after that many bytes sent, 0 = never. */
+  uint32_t dropAfter{0};
+};
+
+/**
+ * @class SimNetwork
+ * @brief In-memory network with a virtual clock, used as the network
+ * controller with NETWORK_CONTROLLER_SIMULATED. Time passes only through
+ * advance() and delay() (the library waits with the latter), so every run
+ * is the same.
+ * @code{.cpp}
+ * SimLink link;
+ * link.latency = 2000;   // 2 ms
+ * link.segmentSize = 7;  // frames arrive in pieces
+ * SimNetwork::setDefaultLink(link);
+ * @endcode
+ */
+class SimNetwork {
+public:
+  /** @brief Applies to connections made from now on. */
+  static void setDefaultLink(const SimLink &link);
+  /** @brief Moves the virtual clock forward (in microseconds). */
+  static void advance(uint32_t duration);
+  /**
+   * @brief Drops every connection and restarts the clock, SimClient objects
+   * from before are left disconnected.
+   */
+  static void reset();
+
+  static uint32_t millis();
+  static uint32_t micros();
+  static void delay(uint32_t ms);
+};
+
+/**
+ * @class SimClient
+ * @brief Endpoint of a simulated connection, copies refer to the same socket
+ * (as EthernetClient does).
+ */
+class SimClient : public Client {
+  friend class SimServer;
+
+public:
+  SimClient() = default;
+
+  /** @brief Connects to SimServer listening on given port (host ignored). */
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  int connect(IPAddress ip, uint16_t port, int32_t timeout);
+  int connect(const char *host, uint16_t port, int32_t timeout);
+
+  size_t write(uint8_t);
+  size_t write(const uint8_t *buffer, size_t size);
+  using Print::write;
+
+  int available();
+  int read();
+  int read(uint8_t *buffer, size_t size);
+  int peek();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+
+  bool operator==(const SimClient &other) const;
+  bool operator!=(const SimClient &other) const;
+
+  IPAddress remoteIP();
+
+  /** @brief Sets properties of the data this endpoint sends. */
+  void setLink(const SimLink &link);
+  /** @brief Resets the connection (unread data is lost). */
+  void drop();
+
+private:
+  explicit SimClient(int8_t socket);
+
+private:
+  int8_t m_socket{-1};
+  /// Generation of the socket, copies made before SimNetwork::reset() (or
+  /// before the socket got released) don't reach its next user
+  uint16_t m_generation{0};
+};
+
+/**
+ * @class SimServer
+ * @brief Accepts simulated connections, available() behaves like the one of
+ * EthernetServer (returns a client with data to read).
+ */
+class SimServer {
+  friend class SimClient;
+
+public:
+  SimServer(uint16_t port);
+  ~SimServer();
+
+  void begin();
+  SimClient available();
+
+  /**
+   * @brief Refuses connections above the limit, e.g. 4 to emulate W5100
+   * (W5500 has 8 sockets).
+   */
+  void setMaxConnections(uint8_t count);
+
+private:
+  uint16_t m_port;
+  uint8_t m_maxConnections{kSimSocketCount};
+};
+
+} // namespace net
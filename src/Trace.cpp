@@ -0,0 +1,101 @@
+#include "Trace.h"
+
+namespace net {
+
+static traceSinkCallback g_traceSink{nullptr};
+static void *g_traceContext{nullptr};
+
+void setTraceSink(const traceSinkCallback &sink, void *context) {
+  g_traceSink = sink;
+  g_traceContext = context;
+}
+
+void printTraceRecord(Print &output, const TraceRecord &record) {
+  output.print(record.time);
+  output.print(' ');
+  output.print(reinterpret_cast<uintptr_t>(record.source));
+  output.print(' ');
+
+  switch (record.event) {
+  case TraceEvent::FRAME_RX:
+  case TraceEvent::FRAME_TX: {
+    output.print(record.event == TraceEvent::FRAME_RX
+                   ? F("RX FRAME : OPCODE=")
+                   : F("TX FRAME : OPCODE="));
+    output.print(record.code);
+    output.print(F(", FIN="));
+    output.print(record.flags & kTraceFin ? 1 : 0);
+    output.print(F(", MASK="));
+    output.print(record.flags & kTraceMask ? 1 : 0);
+    output.print(F(", PAYLOAD-LEN="));
+    break;
+  }
+  case TraceEvent::HANDSHAKE: {
+    output.print(F("HANDSHAKE : STEP="));
+    output.print(record.code);
+    output.print(F(", STATUS="));
+    break;
+  }
+  case TraceEvent::STATE: {
+    output.print(F("STATE : "));
+    output.println(record.code);
+    return;
+  }
+  case TraceEvent::CLOSE: {
+    output.print(record.code ? F("TX CLOSE : CODE=") : F("RX CLOSE : CODE="));
+    break;
+  }
+  }
+  output.println(record.value);
+}
+
+//
+// TraceBuffer class implementation:
+//
+
+void TraceBuffer::sink(const TraceRecord &record, void *buffer) {
+  static_cast<TraceBuffer *>(buffer)->push(record);
+}
+
+void TraceBuffer::push(const TraceRecord &record) {
+  if (m_count == m_capacity) {
+    m_head = (m_head + 1) % m_capacity;
+    --m_count;
+    ++m_dropped;
+  }
+  m_records[(m_head + m_count) % m_capacity] = record;
+  ++m_count;
+}
+bool TraceBuffer::pop(TraceRecord &record) {
+  if (m_count == 0) return false;
+
+  record = m_records[m_head];
+  m_head = (m_head + 1) % m_capacity;
+  --m_count;
+  return true;
+}
+
+uint16_t TraceBuffer::count() const { return m_count; }
+uint32_t TraceBuffer::countDropped() const { return m_dropped; }
+void TraceBuffer::clear() {
+  m_head = 0;
+  m_count = 0;
+  m_dropped = 0;
+}
+
+TraceBuffer::TraceBuffer(TraceRecord *records, uint16_t capacity)
+  : m_records{records}, m_capacity{capacity} {}
+
+//
+// Hooks:
+//
+
+void trace(const TraceEvent event, const void *source, uint8_t code,
+  uint8_t flags, uint16_t value) {
+  if (!g_traceSink) return;
+
+  const TraceRecord record{clockMicros(), source, event, code, flags, value};
+  g_traceSink(record, g_traceContext);
+}
+
+} // namespace net
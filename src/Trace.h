@@ -0,0 +1,127 @@
+#pragma once
+
+/** @file */
+
+#include "utility.h"
+
+namespace net {
+
+/** Events reported to the trace sink, see TraceRecord. */
+enum class TraceEvent : uint8_t {
+  /** code = opcode, flags = kTraceFin | kTraceMask, value = payload length */
+  FRAME_RX,
+  /** code = opcode, flags = kTraceFin | kTraceMask, value = payload length */
+  FRAME_TX,
+  /**
+   * code = handshake step of a client (0 for server), value = 101 if
+   * accepted, 200/304 if a static asset was served, WebSocketError otherwise
+   * (0 when a client enters a step)
+   */
+  HANDSHAKE,
+  /** code = new WebSocket::ReadyState */
+  STATE,
+  /** code = 1 if sent, 0 if received, value = close code */
+  CLOSE
+};
+
+constexpr uint8_t kTraceFin{0x01};
+constexpr uint8_t kTraceMask{0x02};
+
+/**
+ * @brief Single trace event, fixed size so it can be stored as is and decoded
+ * later (e.g. on a host).
+ */
+struct TraceRecord {
+  /** micros() */
+  uint32_t time;
+  /** WebSocket or server (handshake events) that emitted the event. */
+  const void *source;
+  TraceEvent event;
+  uint8_t code;
+  uint8_t flags;
+  uint16_t value;
+};
+
+/**
+ * @param record Valid only during the call.
+ * @param context Pointer given to setTraceSink().
+ */
+using traceSinkCallback = void (*)(const TraceRecord &record, void *context);
+
+/**
+ * @brief Routes trace events (see _TRACE in config.h) to the sink, nullptr
+ * disables tracing.
+ * @code{.cpp}
+ * BasicTraceBuffer<64> traces;
+ * setTraceSink(TraceBuffer::sink, &traces);
+ * @endcode
+ * @note The sink is called synchronously, keep it short.
+ */
+void setTraceSink(const traceSinkCallback &sink, void *context = nullptr);
+
+/** @brief Prints a record as a single line of text. */
+void printTraceRecord(Print &output, const TraceRecord &record);
+
+/**
+ * @class TraceBuffer
+ * @brief Ring buffer of trace records, overwrites the oldest one when full.
+ * @see BasicTraceBuffer
+ */
+class TraceBuffer {
+public:
+  /** @brief Sink for setTraceSink(), context has to be a TraceBuffer. */
+  static void sink(const TraceRecord &record, void *buffer);
+
+public:
+  TraceBuffer(const TraceBuffer &) = delete;
+  TraceBuffer &operator=(const TraceBuffer &) = delete;
+
+  void push(const TraceRecord &record);
+  /** @brief Takes the oldest record. */
+  bool pop(TraceRecord &record);
+
+  /** @return Number of stored records. */
+  uint16_t count() const;
+  /** @return Number of records overwritten since the last clear(). */
+  uint32_t countDropped() const;
+  void clear();
+
+protected:
+  /** @param records Array of capacity elements. */
+  TraceBuffer(TraceRecord *records, uint16_t capacity);
+
+private:
+  TraceRecord *m_records;
+  uint16_t m_capacity;
+  /// Index of the oldest record
+  uint16_t m_head{0};
+  uint16_t m_count{0};
+  uint32_t m_dropped{0};
+};
+
+/**
+ * @class BasicTraceBuffer
+ * @brief Ring buffer of Capacity trace records.
+ */
+template <uint16_t Capacity> class BasicTraceBuffer final : public TraceBuffer {
+  static_assert(Capacity > 0, "Trace buffer can't be empty");
+
+public:
+  BasicTraceBuffer() : TraceBuffer{m_buffer, Capacity} {}
+
+private:
+  TraceRecord m_buffer[Capacity]{};
+};
+
+/** @cond */
+void trace(const TraceEvent, const void *source, uint8_t code, uint8_t flags,
+  uint16_t value);
+/** @endcond */
+
+} // namespace net
+
+#ifdef _TRACE
+#  define __trace(...) ::net::trace(__VA_ARGS__)
+#else
+#  define __trace(...)
+#endif
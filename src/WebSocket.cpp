@@ -24,6 +24,29 @@ constexpr bool isCloseCodeValid(uint16_t code) {
             code != WebSocket::CloseCode::ABNORMAL_CLOSURE) ||
           (code >= 3000 && code <= 4999));
 }
+#ifdef _TRAFFIC_STATS
+/** Index of reserved opcodes (not counted). */
+constexpr uint8_t kNoStatsIndex{0xFF};
+/** @return Index of the opcode in WebSocketStats::in/out. */
+constexpr uint8_t statsIndex(uint8_t opcode) {
+  return opcode <= WebSocket::Opcode::BINARY_FRAME ? opcode
+         : isControlFrame(opcode)                  ? opcode - 5
+                                                   : kNoStatsIndex;
+}
+/** Returned for reserved opcodes. */
+const WebSocketStats::Counter kNoCounter{};
+
+void countFrame(
+  WebSocketStats::Counter counters[], uint8_t opcode, uint32_t length) {
+  // Reserved opcodes are not counted (connection gets closed anyway)
+  const auto index = statsIndex(opcode);
+  if (index == kNoStatsIndex) return;
+
+  auto &counter = counters[index];
+  ++counter.frames;
+  counter.bytes += length;
+}
+#endif
 
 bool encodeSecKey(const char *key, char output[]) {
   constexpr auto kSecKeyLength = 24;
@@ -42,11 +65,33 @@ bool encodeSecKey(const char *key, char output[]) {
   return true;
 }
 
-/** @param[out] output Array of 4 elements (without NULL). */
-void generateMask(char output[]) {
-  randomSeed(analogRead(A0));
-  for (byte i = 0; i < 4; ++i)
-    output[i] = static_cast<char>(random(0xFF));
+uint8_t encodeFrameHeader(char output[], uint8_t opcode, bool fin,
+  uint16_t length, const char *maskingKey) {
+  uint8_t size{0};
+  output[size++] = opcode | (fin ? 0x80 : 0x00);
+
+  const char mask = maskingKey ? 0x80 : 0x00;
+  if (length <= 125) {
+    output[size++] = mask | static_cast<char>(length);
+  } else {
+    output[size++] = mask | 126;
+    output[size++] = static_cast<char>(length >> 8) & 0xFF;
+    output[size++] = static_cast<char>(length & 0xFF);
+  }
+
+  if (maskingKey) {
+    memcpy(&output[size], maskingKey, 4);
+    size += 4;
+  }
+  return size;
+}
+const char *findProtocol(
+  const char *const protocols[], uint8_t count, const char *name) {
+  if (!name) return nullptr;
+  for (uint8_t i = 0; i < count; ++i)
+    if (strcmp(protocols[i], name) == 0) return protocols[i];
+
+  return nullptr;
 }
 
 /**
@@ -123,22 +168,49 @@ bool isValidUTF8(const byte *s, size_t length) {
 // 	|                     Payload Data continued ...                |
 // 	+---------------------------------------------------------------+
 
-/** @cond */
-struct WebSocket::header_t {
-  bool fin;
-  bool rsv1, rsv2, rsv3;
-  uint8_t opcode;
-  bool mask;
-  char maskingKey[4]{};
-  uint32_t length;
-};
-/** @endcond */
+
+#ifdef _TRAFFIC_STATS
+//
+// WebSocketStats struct implementation:
+//
+
+const WebSocketStats::Counter &WebSocketStats::received(uint8_t opcode) const {
+  const auto index = statsIndex(opcode);
+  return index != kNoStatsIndex ? in[index] : kNoCounter;
+}
+const WebSocketStats::Counter &WebSocketStats::sent(uint8_t opcode) const {
+  const auto index = statsIndex(opcode);
+  return index != kNoStatsIndex ? out[index] : kNoCounter;
+}
+
+WebSocketStats &WebSocketStats::operator+=(const WebSocketStats &other) {
+  for (uint8_t i = 0; i < 6; ++i) {
+    in[i].frames += other.in[i].frames;
+    in[i].bytes += other.in[i].bytes;
+    out[i].frames += other.out[i].frames;
+    out[i].bytes += other.out[i].bytes;
+  }
+  messages += other.messages;
+  fragmentedMessages += other.fragmentedMessages;
+  protocolErrors += other.protocolErrors;
+  if (other.sendQueueHighWater > sendQueueHighWater)
+    sendQueueHighWater = other.sendQueueHighWater;
+  writes += other.writes;
+
+  return *this;
+}
+#endif
 
 //
 // WebSocket class implementation (public):
 //
 
-WebSocket::~WebSocket() { terminate(); }
+WebSocket::onDestroyCallback WebSocket::s_onDestroy{nullptr};
+
+WebSocket::~WebSocket() {
+  if (s_onDestroy) s_onDestroy(*this);
+  WebSocket::terminate();
+}
 
 void WebSocket::close(
   const CloseCode code, bool instant, const char *reason, uint16_t length) {
@@ -148,23 +220,18 @@ void WebSocket::close(
     return;
   }
 
-  m_readyState = ReadyState::CLOSING;
   char buffer[128]{
     static_cast<char>((code >> 8) & 0xFF), static_cast<char>(code & 0xFF)};
 
   if (length) memcpy(&buffer[2], reason, length);
-  _send(CONNECTION_CLOSE_FRAME, true, m_maskEnabled, buffer, 2 + length);
-
-  if (instant) {
-    terminate();
-    if (_onClose) _onClose(*this, code, reason, length);
-  }
+  _close(buffer, 2 + length, code, instant, reason, length);
 }
 void WebSocket::terminate() {
+  flush();
   m_client.flush();
   m_client.stop();
-  m_readyState = ReadyState::CLOSED;
-  SAFE_DELETE_ARRAY(m_protocol);
+  _setReadyState(ReadyState::CLOSED);
+  m_protocol = nullptr;
   _clearDataBuffer();
 }
 
@@ -175,16 +242,19 @@ bool WebSocket::isAlive() const {
 
 IPAddress WebSocket::getRemoteIP() const { return fetchRemoteIp(m_client); }
 const char *WebSocket::getProtocol() const { return m_protocol; }
+const Route *WebSocket::getRoute() const { return m_route; }
+uint32_t WebSocket::getId() const { return m_id; }
 
-void WebSocket::send(
+bool WebSocket::send(
   const WebSocket::DataType dataType, const char *message, uint16_t length) {
   if (m_readyState != ReadyState::OPEN) {
     // #TODO Trigger error ...
-    return;
+    return false;
   }
 
-  _send(dataType == DataType::TEXT ? TEXT_FRAME : BINARY_FRAME, true,
-    m_maskEnabled, message, length);
+  _send(dataType == DataType::TEXT ? TEXT_FRAME : BINARY_FRAME, true, message,
+    length);
+  return true;
 }
 void WebSocket::ping(const char *payload, uint16_t length) {
   if (m_readyState != ReadyState::OPEN) {
@@ -192,7 +262,40 @@ void WebSocket::ping(const char *payload, uint16_t length) {
     return;
   }
 
-  _send(PING_FRAME, true, m_maskEnabled, payload, length);
+  if (!payload || length == 0) {
+    // Sequence number and send time (big-endian), echoed back in pong
+    if (++m_pingSequence == 0) ++m_pingSequence; // 0 = no ping sent yet
+    const uint32_t now{clockMicros()};
+    const char stamp[kPingStampSize]{
+      static_cast<char>(m_pingSequence >> 8),
+      static_cast<char>(m_pingSequence & 0xFF),
+      static_cast<char>(now >> 24),
+      static_cast<char>((now >> 16) & 0xFF),
+      static_cast<char>((now >> 8) & 0xFF),
+      static_cast<char>(now & 0xFF),
+    };
+    return _send(PING_FRAME, true, stamp, kPingStampSize);
+  }
+
+  _send(PING_FRAME, true, payload, length);
+}
+
+uint32_t WebSocket::getRTT() const { return m_smoothedRTT; }
+uint32_t WebSocket::getRTTVariance() const { return m_rttVariance; }
+uint32_t WebSocket::getLastSeen() const { return m_lastSeen; }
+
+void WebSocket::setWriteBuffer(char *buffer, uint16_t size, uint16_t maxDelay) {
+  flush();
+  m_writeBuffer = buffer;
+  m_writeBufferSize = buffer ? size : 0;
+  m_writeDelay = maxDelay;
+}
+void WebSocket::flush() {
+  if (m_writeBufferUsed == 0) return;
+
+  m_client.write(m_writeBuffer, m_writeBufferUsed);
+  __updateStats(++m_stats.writes);
+  m_writeBufferUsed = 0;
 }
 
 void WebSocket::onClose(const onCloseCallback &callback) {
@@ -201,31 +304,48 @@ void WebSocket::onClose(const onCloseCallback &callback) {
 void WebSocket::onMessage(const onMessageCallback &callback) {
   _onMessage = callback;
 }
+WebSocket::onMessageCallback WebSocket::getOnMessage() const {
+  return _onMessage;
+}
 void WebSocket::onPing(const onPingCallback &callback) { _onPing = callback; }
+void WebSocket::onPong(const onPongCallback &callback) { _onPong = callback; }
+
+void WebSocket::setUserData(void *userData) { m_userData = userData; }
+void *WebSocket::getUserData() const { return m_userData; }
+void WebSocket::setDestroyHook(const onDestroyCallback &callback) {
+  s_onDestroy = callback;
+}
+
+#ifdef _TRAFFIC_STATS
+WebSocketStats WebSocket::getStats() const { return m_stats; }
+void WebSocket::resetStats() { m_stats = WebSocketStats{}; }
+#endif
 
 //
 // Protected:
 //
 
-WebSocket::WebSocket(const NetClient &client, const char *protocol)
-  : m_client{client}, m_readyState{ReadyState::OPEN}, m_maskEnabled{false} {
-  if (protocol) {
-    m_protocol = new char[strlen(protocol) + 1];
-    strcpy(m_protocol, protocol);
-  }
-}
+WebSocket::WebSocket(char *buffer, uint16_t bufferSize)
+  : m_dataBuffer{buffer}, m_bufferSize{bufferSize}, m_ownBuffer{buffer},
+    m_ownBufferSize{bufferSize} {}
+WebSocket::WebSocket(const NetClient &client, const char *protocol,
+  char *buffer, uint16_t bufferSize)
+  : m_client{client}, m_readyState{ReadyState::OPEN}, m_protocol{protocol},
+    m_dataBuffer{buffer}, m_bufferSize{bufferSize}, m_ownBuffer{buffer},
+    m_ownBufferSize{bufferSize}, m_lastSeen{clockMillis()} {}
 
 int32_t WebSocket::_read() {
-  const uint32_t timeout{millis() + kTimeoutInterval};
-  while (!m_client.available() && millis() < timeout) {
-    delay(1);
+  const uint32_t timeout{clockMillis() + kTimeoutInterval};
+  while (!m_client.available() && clockMillis() < timeout) {
+    clockDelay(1);
   }
 
-  if (millis() > timeout) {
-    close(PROTOCOL_ERROR, true);
+  if (clockMillis() > timeout) {
+    WebSocket::close(PROTOCOL_ERROR, true);
     return -1;
   }
 
+  ++m_bytesRead;
   return m_client.read();
 }
 bool WebSocket::_read(char *buffer, size_t size, size_t offset) {
@@ -239,85 +359,74 @@ bool WebSocket::_read(char *buffer, size_t size, size_t offset) {
   return true;
 }
 
-void WebSocket::_send(
-  uint8_t opcode, bool fin, bool mask, const char *data, uint16_t length) {
-  uint16_t bytesWritten{0};
-  bytesWritten += m_client.write(opcode | (fin ? 0x80 : 0x00));
+void WebSocket::_write(const char *data, uint16_t length) {
+  if (m_writeBuffer && length <= m_writeBufferSize) {
+    if (m_writeBufferUsed + length > m_writeBufferSize) flush();
+    if (m_writeBufferUsed == 0) m_writeTime = clockMillis();
 
-  if (length <= 125) {
-    bytesWritten +=
-      m_client.write((mask ? 0x80 : 0x00) | static_cast<char>(length));
-  } else if (length <= 0xFFFF) {
-    bytesWritten += m_client.write((mask ? 0x80 : 0x00) | 126);
-    bytesWritten += m_client.write(static_cast<char>(length >> 8) & 0xFF);
-    bytesWritten += m_client.write(static_cast<char>(length & 0xFF));
-  } else
-    return; // too big ...
-
-#ifdef _DUMP_HEADER
-  printf(F("TX FRAME : OPCODE=%u, FIN=%s, RSV=0, PAYLOAD-LEN=%u, MASK="),
-    opcode, fin ? "True" : "False", length);
-#endif
-
-  if (mask) {
-    char maskingKey[4]{};
-    generateMask(maskingKey);
-
-#ifdef _DUMP_HEADER
-    printf(F("%x%x%x%x\n"), maskingKey[0], maskingKey[1], maskingKey[2],
-      maskingKey[3]);
-#endif
-
-    bytesWritten += m_client.write(maskingKey, 4);
-    for (uint16_t i = 0; i < length; ++i)
-      bytesWritten +=
-        m_client.write(static_cast<char>(data[i] ^ maskingKey[i % 4]));
-  } else {
-#ifdef _DUMP_HEADER
-    printf(F("None\n"));
-#endif
-
-    if (length) {
-      bytesWritten +=
-        m_client.write(reinterpret_cast<const char *>(data), length);
-    }
+    memcpy(&m_writeBuffer[m_writeBufferUsed], data, length);
+    m_writeBufferUsed += length;
+    return;
   }
 
-#ifdef _DUMP_FRAME_DATA
-  if (length) printf(F("%s\n"), data);
-#endif
+  flush(); // Keeps frames in order
+  m_client.write(data, length);
+  __updateStats(++m_stats.writes);
+}
+void WebSocket::_flushIfDue() {
+  if (m_writeBufferUsed && clockMillis() - m_writeTime >= m_writeDelay)
+    flush();
+}
 
-#ifdef _DUMP_HEADER
-  printf(F("TX BYTES = %u\n"), bytesWritten);
+void WebSocket::_sendUnmasked(
+  uint8_t opcode, bool fin, const char *data, uint16_t length) {
+  __measureLatency(const uint32_t startTime{clockMicros()});
+
+  // Header goes out in a single write
+  char header[kMaxFrameHeaderSize]{};
+  const auto headerSize =
+    encodeFrameHeader(header, opcode, fin, length, nullptr);
+  _write(header, headerSize);
+  if (length) _write(data, length);
+
+  __trace(TraceEvent::FRAME_TX, this, opcode, fin ? kTraceFin : 0, length);
+  __updateStats(countFrame(m_stats.out, opcode, length));
+#ifdef _LATENCY_HISTOGRAMS
+  if (m_histograms) m_histograms->write.record(clockMicros() - startTime);
 #endif
 }
 
 void WebSocket::_readFrame() {
   if (m_readyState == ReadyState::CLOSED) return;
 
+  __measureLatency(const uint32_t startTime{clockMicros()}; m_dispatchTime = 0);
+
   header_t header;
-  if (!_readHeader(header)) return;
+  if (m_framePending)
+    header = m_pendingHeader;
+  else if (!_readHeader(header))
+    return;
 
-  bool usingTempBuffer = isControlFrame(header.opcode);
-  char *payload{nullptr};
-  size_t offset{0};
+  // Control frames (close/ping/pong) must not interrupt a fragmented message
+  // in m_dataBuffer, their payload goes on the stack (+ NULL terminator).
+  // PONG is sent back straight from there.
+  char controlPayload[kMaxControlPayloadSize + 1]{};
+  char *payload{m_dataBuffer};
+  size_t offset{m_currentOffset};
 
-  if (usingTempBuffer) {
-    payload = new char[header.length + 1]{};
+  if (isControlFrame(header.opcode)) {
+    payload = controlPayload;
+    offset = 0;
   } else {
-    payload = m_dataBuffer;
-    offset = m_currentOffset;
-
-    if (header.length + offset >= kBufferMaxSize)
-      return close(CloseCode::MESSAGE_TOO_BIG, true);
+    if (!_reserveBuffer(header)) return;
+    payload = m_dataBuffer; // Might have been swapped for a pool buffer
   }
 
   if (header.length > 0) {
-    if (!_readData(header, payload, offset)) {
-      if (usingTempBuffer) SAFE_DELETE_ARRAY(payload);
-      return;
-    }
+    if (!_readData(header, &payload[offset])) return;
   }
+  __updateStats(countFrame(m_stats.in, header.opcode, header.length));
+  m_lastSeen = clockMillis();
 
   switch (header.opcode) {
   case Opcode::CONTINUATION_FRAME: {
@@ -334,23 +443,30 @@ void WebSocket::_readFrame() {
     break;
   }
   case Opcode::PING_FRAME: {
-    _send(PONG_FRAME, true, m_maskEnabled, payload, header.length);
+    _send(PONG_FRAME, true, payload, header.length);
     if (_onPing) {
       _onPing(*this, payload, header.length);
     }
     break;
   }
   case Opcode::PONG_FRAME: {
+    const auto rtt = _handlePongFrame(payload, header.length);
+    if (_onPong) {
+      _onPong(*this, payload, header.length, rtt);
+    }
     break;
   }
   default: {
     __debugOutput(F("Unrecognized frame opcode: %u\n"), header.opcode);
-    close(PROTOCOL_ERROR, true);
+    _fail(PROTOCOL_ERROR);
     break;
   }
   }
 
-  if (usingTempBuffer) SAFE_DELETE_ARRAY(payload);
+#ifdef _LATENCY_HISTOGRAMS
+  if (m_histograms)
+    m_histograms->frame.record(clockMicros() - startTime - m_dispatchTime);
+#endif
 }
 bool WebSocket::_readHeader(header_t &header) {
   char temp[2]{};
@@ -367,7 +483,7 @@ bool WebSocket::_readHeader(header_t &header) {
     __debugOutput(F("RSV1 = %d, RSV2 = %d, RSV3 = %d\n"), header.rsv1,
       header.rsv2, header.rsv3);
 
-    close(PROTOCOL_ERROR, true);
+    _fail(PROTOCOL_ERROR);
     return false;
   }
 
@@ -378,15 +494,15 @@ bool WebSocket::_readHeader(header_t &header) {
     if (!header.fin) {
       __debugOutput(F("Control frames must not be fragmented!\n"));
 
-      close(PROTOCOL_ERROR, true);
+      _fail(PROTOCOL_ERROR);
       return false;
     }
 
-    if (header.length > 125) {
+    if (header.length > kMaxControlPayloadSize) {
       __debugOutput(
         F("Control frames max length = 125, here = %u\n"), header.length);
 
-      close(PROTOCOL_ERROR, true);
+      _fail(PROTOCOL_ERROR);
       return false;
     }
   }
@@ -401,62 +517,99 @@ bool WebSocket::_readHeader(header_t &header) {
   } else if (header.length == 127) {
     __debugOutput(F("Unsupported frame size!\n"));
 
-    close(MESSAGE_TOO_BIG, true);
+    _fail(MESSAGE_TOO_BIG);
     return false;
   }
 
-  if (header.length > kBufferMaxSize) {
+  if (header.length > _maxMessageSize()) {
     __debugOutput(F("Unsupported frame size = %u\n"), header.length);
 
-    close(MESSAGE_TOO_BIG, true);
+    _fail(MESSAGE_TOO_BIG);
     return false;
   }
 
   if (header.mask)
     if (!_read(header.maskingKey, 4)) return false;
 
-#ifdef _DUMP_HEADER
-  printf(F("RX FRAME : OPCODE=%u, FIN=%s, RSV=%d, PAYLOAD-LEN=%u, MASK="),
-    header.opcode, header.fin ? "True" : "False", header.rsv1, header.length);
+  __trace(TraceEvent::FRAME_RX, this, header.opcode,
+    (header.fin ? kTraceFin : 0) | (header.mask ? kTraceMask : 0),
+    header.length);
+  return true;
+}
+bool WebSocket::_readMaskedData(const header_t &header, char *payload) {
+  if (!header.mask) {
+    __debugOutput(F("Client frames must be masked!\n"));
+    _fail(PROTOCOL_ERROR);
+    return false;
+  }
 
-  !header.mask
-    ? printf(F("None\n"))
-    : printf(F("%x%x%x%x\n"), header.maskingKey[0], header.maskingKey[1],
-        header.maskingKey[2], header.maskingKey[3]);
-#endif
+  if (!_read(payload, header.length)) return false;
+  for (uint32_t i = 0; i < header.length; ++i)
+    payload[i] ^= header.maskingKey[i % 4];
 
   return true;
 }
-bool WebSocket::_readData(
-  const header_t &header, char *payload, size_t offset) {
-  int32_t bite{-1};
 
-  if (header.mask) {
-    for (uint32_t i = 0; i < header.length; ++i) {
-      if ((bite = _read()) == -1) return false;
-      payload[offset + i] = bite ^ header.maskingKey[i % 4];
-    }
-  } else {
-    if (!_read(payload, header.length, offset)) {
-      return false;
-    }
+uint16_t WebSocket::_maxMessageSize() const {
+  return m_bufferPool && m_bufferPool->getBufferSize() > m_ownBufferSize
+           ? m_bufferPool->getBufferSize()
+           : m_ownBufferSize;
+}
+bool WebSocket::_reserveBuffer(const header_t &header) {
+  // + NULL terminator
+  const uint32_t requiredSize{m_currentOffset + header.length + 1};
+  if (requiredSize <= m_bufferSize) {
+    m_framePending = false;
+    return true;
   }
 
-#ifdef _DUMP_FRAME_DATA
-  if (header.length) printf(F("%s\n"), payload);
-#endif
+  if (!m_bufferPool || m_dataBuffer != m_ownBuffer ||
+      requiredSize > m_bufferPool->getBufferSize()) {
+    m_framePending = false;
+    _fail(CloseCode::MESSAGE_TOO_BIG);
+    return false;
+  }
 
-  return true;
-}
+  auto buffer = m_bufferPool->_acquire();
+  if (buffer) {
+    // Carry over fragments received so far
+    memcpy(buffer, m_dataBuffer, m_currentOffset);
+    memset(&buffer[m_currentOffset], '\0',
+      m_bufferPool->getBufferSize() - m_currentOffset);
+    m_dataBuffer = buffer;
+    m_bufferSize = m_bufferPool->getBufferSize();
+    m_framePending = false;
+    return true;
+  }
 
+  if (m_bufferPool->m_policy == MessageBufferPool::ExhaustionPolicy::WAIT) {
+    if (!m_framePending) {
+      m_pendingHeader = header;
+      m_framePending = true;
+      m_waitStart = clockMillis();
+    }
+    if (clockMillis() - m_waitStart < m_bufferPool->m_waitTimeout) return false;
+  }
+
+  __debugOutput(F("No message buffer available\n"));
+  m_framePending = false;
+  WebSocket::close(CloseCode::TRY_AGAIN_LATER, true);
+  return false;
+}
 void WebSocket::_clearDataBuffer() {
-  memset(m_dataBuffer, '\0', kBufferMaxSize);
+  if (m_dataBuffer != m_ownBuffer) {
+    m_bufferPool->_release(m_dataBuffer);
+    m_dataBuffer = m_ownBuffer;
+    m_bufferSize = m_ownBufferSize;
+  }
+  memset(m_dataBuffer, '\0', m_bufferSize);
   m_currentOffset = 0;
   m_tbcOpcode = -1;
+  m_framePending = false;
 }
 
 void WebSocket::_handleContinuationFrame(const header_t &header) {
-  if (m_tbcOpcode == -1) return close(PROTOCOL_ERROR, true);
+  if (m_tbcOpcode == -1) return _fail(PROTOCOL_ERROR);
 
   if (header.fin) {
     const auto totalLength = m_currentOffset + header.length;
@@ -465,19 +618,18 @@ void WebSocket::_handleContinuationFrame(const header_t &header) {
     if (dataType == DataType::TEXT) {
       if (!isValidUTF8(
             reinterpret_cast<const byte *>(m_dataBuffer), totalLength))
-        return close(INVALID_FRAME_PAYLOAD_DATA, true);
+        return _fail(INVALID_FRAME_PAYLOAD_DATA);
     }
 
-    if (_onMessage) {
-      _onMessage(*this, dataType, m_dataBuffer, totalLength);
-    }
+    __updateStats(++m_stats.messages; ++m_stats.fragmentedMessages);
+    _dispatchMessage(dataType, m_dataBuffer, totalLength);
     _clearDataBuffer();
   } else {
     m_currentOffset += header.length;
   }
 }
 void WebSocket::_handleDataFrame(const header_t &header) {
-  if (m_currentOffset > 0) return close(PROTOCOL_ERROR, true);
+  if (m_currentOffset > 0) return _fail(PROTOCOL_ERROR);
 
   if (header.fin) {
     const auto dataType =
@@ -486,18 +638,29 @@ void WebSocket::_handleDataFrame(const header_t &header) {
     if (dataType == DataType::TEXT) {
       if (!isValidUTF8(
             reinterpret_cast<const byte *>(m_dataBuffer), header.length))
-        return close(INVALID_FRAME_PAYLOAD_DATA, true);
+        return _fail(INVALID_FRAME_PAYLOAD_DATA);
     }
 
-    if (_onMessage) {
-      _onMessage(*this, dataType, m_dataBuffer, header.length);
-    }
+    __updateStats(++m_stats.messages);
+    _dispatchMessage(dataType, m_dataBuffer, header.length);
     _clearDataBuffer();
   } else {
     m_currentOffset += header.length;
     m_tbcOpcode = header.opcode;
   }
 }
+void WebSocket::_dispatchMessage(
+  const DataType dataType, const char *message, uint16_t length) {
+  if (!_onMessage) return;
+
+  __measureLatency(const uint32_t startTime{clockMicros()});
+  _onMessage(*this, dataType, message, length);
+#ifdef _LATENCY_HISTOGRAMS
+  const uint32_t duration{clockMicros() - startTime};
+  m_dispatchTime += duration;
+  if (m_histograms) m_histograms->dispatch.record(duration);
+#endif
+}
 void WebSocket::_handleCloseFrame(const header_t &header, const char *payload) {
   uint16_t code{NORMAL_CLOSURE};
   const char *reason{nullptr};
@@ -507,19 +670,88 @@ void WebSocket::_handleCloseFrame(const header_t &header, const char *payload) {
     for (byte i = 0; i < 2; ++i)
       code = (code << 8) + (payload[i] & 0xFF);
 
-    if (!isCloseCodeValid(code)) return close(PROTOCOL_ERROR, true);
+    if (!isCloseCodeValid(code)) return _fail(PROTOCOL_ERROR);
 
     reasonLength = header.length - 2;
     reason = &payload[2];
     if (!isValidUTF8(reinterpret_cast<const byte *>(reason), reasonLength))
-      return close(PROTOCOL_ERROR, true);
+      return _fail(PROTOCOL_ERROR);
   }
 
   __debugOutput(F("Received close frame: code = %u, reason = %s\n"), code,
     header.length ? reason : " ");
+  __trace(TraceEvent::CLOSE, this, 0, 0, code);
+
+  if (m_readyState != ReadyState::OPEN) return;
+  // Echoed straight from the received payload (close() would need another
+  // buffer on the stack, under the one of _readFrame())
+  if (header.length > 0) {
+    _close(payload, header.length, static_cast<CloseCode>(code), true, reason,
+      reasonLength);
+  } else {
+    const char normalClosure[2]{static_cast<char>((code >> 8) & 0xFF),
+      static_cast<char>(code & 0xFF)};
+    _close(normalClosure, 2, static_cast<CloseCode>(code), true, nullptr, 0);
+  }
+}
+void WebSocket::_close(const char *payload, uint16_t payloadLength,
+  const CloseCode code, bool instant, const char *reason, uint16_t length) {
+  _setReadyState(ReadyState::CLOSING);
+  _send(CONNECTION_CLOSE_FRAME, true, payload, payloadLength);
+  __trace(TraceEvent::CLOSE, this, 1, 0, code);
+
+  if (instant) {
+    // Not the override, closing on behalf of the endpoint keeps the client
+    // reconnecting
+    WebSocket::terminate();
+    if (_onClose) _onClose(*this, code, reason, length);
+  }
+}
+
+uint32_t WebSocket::_handlePongFrame(const char *payload, uint16_t length) {
+  if (length != kPingStampSize || m_pingSequence == 0) return 0;
+
+  const uint16_t sequence = (static_cast<uint8_t>(payload[0]) << 8) |
+                            static_cast<uint8_t>(payload[1]);
+  // Unsolicited pong, or an answer to a long forgotten ping
+  if (sequence == 0 ||
+      static_cast<uint16_t>(m_pingSequence - sequence) >= kMaxPingsInFlight)
+    return 0;
+
+  uint32_t sentAt{0};
+  for (uint8_t i = 2; i < kPingStampSize; ++i)
+    sentAt = (sentAt << 8) | static_cast<uint8_t>(payload[i]);
+  uint32_t rtt{clockMicros() - sentAt};
+  if (rtt == 0) rtt = 1; // 0 stands for "not measured"
+
+  // RFC 6298 (2.2 and 2.3), alpha = 1/8, beta = 1/4
+  if (m_smoothedRTT == 0) {
+    m_smoothedRTT = rtt;
+    m_rttVariance = rtt / 2;
+  } else {
+    const uint32_t delta{
+      m_smoothedRTT > rtt ? m_smoothedRTT - rtt : rtt - m_smoothedRTT};
+    m_rttVariance = m_rttVariance - m_rttVariance / 4 + delta / 4;
+    m_smoothedRTT = m_smoothedRTT - m_smoothedRTT / 8 + rtt / 8;
+  }
+  return rtt;
+}
+void WebSocket::_resetPingState() {
+  m_pingSequence = 0;
+  m_smoothedRTT = 0;
+  m_rttVariance = 0;
+  m_lastSeen = clockMillis();
+}
+
+void WebSocket::_fail(const CloseCode code) {
+  __updateStats(++m_stats.protocolErrors);
+  WebSocket::close(code, true);
+}
+void WebSocket::_setReadyState(const ReadyState readyState) {
+  if (m_readyState == readyState) return;
 
-  if (m_readyState == ReadyState::OPEN)
-    close(static_cast<CloseCode>(code), true, reason, reasonLength);
+  m_readyState = readyState;
+  __trace(TraceEvent::STATE, this, static_cast<uint8_t>(readyState), 0, 0);
 }
 
 } // namespace net
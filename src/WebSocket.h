@@ -2,6 +2,9 @@
 
 /** @file */
 
+#include "LatencyHistogram.h"
+#include "MessageBufferPool.h"
+#include "Trace.h"
 #include "utility.h"
 
 namespace net {
@@ -27,6 +30,7 @@ enum class WebSocketError {
   //
 
   BAD_REQUEST = 400,
+  NOT_FOUND = 404,
   REQUEST_TIMEOUT = 408,
   UPGRADE_REQUIRED = 426,
 
@@ -39,12 +43,71 @@ enum class WebSocketError {
   SERVICE_UNAVAILABLE = 503
 };
 
+template <uint8_t, uint16_t> class BasicWebSocketServer;
+struct Route;
+
+#ifdef _TRAFFIC_STATS
+/**
+ * @brief Traffic counters of an endpoint (or of all endpoints of a server).
+ * @note Available with _TRAFFIC_STATS defined (see config.h).
+ * @see WebSocket::getStats(), WebSocketServerBase::getStats()
+ */
+struct WebSocketStats {
+  /** Frames of a single opcode and their payload bytes. */
+  struct Counter {
+    uint32_t frames{0};
+    uint32_t bytes{0};
+  };
+
+  /**
+   * @return Counter of received frames with given opcode (always zero for
+   * reserved opcodes).
+   */
+  const Counter &received(uint8_t opcode) const;
+  /**
+   * @return Counter of sent frames with given opcode (always zero for
+   * reserved opcodes).
+   */
+  const Counter &sent(uint8_t opcode) const;
+
+  WebSocketStats &operator+=(const WebSocketStats &);
+
+  /** @cond */
+  /// Continuation, text, binary, close, ping, pong
+  Counter in[6]{};
+  Counter out[6]{};
+  /** @endcond */
+
+  /// Complete data messages received
+  uint32_t messages{0};
+  /// Received messages reassembled from more than one frame
+  uint32_t fragmentedMessages{0};
+  /// Connections closed because of an invalid (or too large) frame/message
+  uint32_t protocolErrors{0};
+  /// Largest number of bytes held in the send queue (client only)
+  uint16_t sendQueueHighWater{0};
+  /// Frame writes handed to the network controller (see setWriteBuffer())
+  uint32_t writes{0};
+};
+#endif
+
 /**
  * @class WebSocket
  */
 class WebSocket {
-  friend class WebSocketServer;
-  struct header_t;
+  friend class WebSocketServerBase;
+
+protected:
+  /** @cond */
+  struct header_t {
+    bool fin;
+    bool rsv1, rsv2, rsv3;
+    uint8_t opcode;
+    bool mask;
+    char maskingKey[4]{};
+    uint32_t length;
+  };
+  /** @endcond */
 
 public:
   /**
@@ -189,6 +252,19 @@ public:
   using onPingCallback = void (*)(
     WebSocket &ws, const char *message, uint16_t length);
 
+  /**
+   * @param ws Source of a message.
+   * @param message Non NULL-terminated.
+   * @param length Number of data bytes.
+   * @param rtt Round trip time (in microseconds) of the ping answered by this
+   * pong, 0 if it doesn't answer a ping sent by ping() without payload.
+   */
+  using onPongCallback = void (*)(
+    WebSocket &ws, const char *message, uint16_t length, uint32_t rtt);
+
+  /** @param ws Endpoint being destroyed. */
+  using onDestroyCallback = void (*)(const WebSocket &ws);
+
 public:
   WebSocket(const WebSocket &) = delete;
   virtual ~WebSocket();
@@ -201,11 +277,13 @@ public:
    * @param reason An additional message (not required), doesn't have to be
    * NULL-terminated. Max length = 123 characters.
    * @param length The number of characters in the reason c-string.
+   * @remark Virtual, so a client closed through WebSocket& (e.g. in a
+   * callback) stops reconnecting as well.
    */
-  void close(const CloseCode, bool instant, const char *reason = nullptr,
-    uint16_t length = 0);
+  virtual void close(const CloseCode, bool instant,
+    const char *reason = nullptr, uint16_t length = 0);
   /** @brief Immediately closes the connection. */
-  void terminate();
+  virtual void terminate();
 
   /** @return Endpoint connection status. */
   ReadyState getReadyState() const;
@@ -217,21 +295,70 @@ public:
    * @remark For some microcontrollers it might be empty.
    */
   IPAddress getRemoteIP() const;
+  /**
+   * @return Negotiated subprotocol (entry of the table given to
+   * setProtocols()) or nullptr.
+   */
   const char *getProtocol() const;
+  /**
+   * @return Entry of the route table the connection came through (see
+   * WebSocketServerBase::setRoutes()) or nullptr.
+   * @note The entry is in PROGMEM, compare its address or read it with
+   * memcpy_P.
+   */
+  const Route *getRoute() const;
+  /**
+   * @return Number of the connection, unique within its server (assigned on
+   * accept, starting at 1, never reused), 0 for a client.
+   * @see PostQueue::post()
+   */
+  uint32_t getId() const;
 
   /**
    * @brief Sends a message frame.
    * @param message Doesn't have to be NULL-terminated.
+   * @return false if the message was dropped (connection not open).
    */
-  void send(const DataType, const char *message, uint16_t length);
+  virtual bool send(const DataType, const char *message, uint16_t length);
   /**
    * @brief Sends a ping message.
    * @param payload An additional message, doesn't have to be NULL-terminated.
-   * Max length = 125.
+   * Max length = 125. Without it the ping carries a sequence number and a
+   * timestamp, so the pong updates round trip time (see getRTT()).
    * @param length The number of characters in payload.
    */
   void ping(const char *payload = nullptr, uint16_t length = 0);
 
+  /**
+   * @return Smoothed round trip time (in microseconds), 0 until the first pong
+   * answering ping().
+   */
+  uint32_t getRTT() const;
+  /** @return Round trip time variation (in microseconds). */
+  uint32_t getRTTVariance() const;
+  /** @return Time (millis()) of the last frame received from the endpoint. */
+  uint32_t getLastSeen() const;
+
+  /**
+   * @brief Enables write combining: frames are appended to the buffer and go
+   * out in a single write when it fills up, on flush() or from listen() of
+   * the server/client (once the oldest frame waited maxDelay).
+   * @code{.cpp}
+   * char cork[256];
+   * ws.setWriteBuffer(cork, sizeof(cork));
+   * ws.send(WebSocket::DataType::TEXT, "t=21.5", 6);
+   * ws.send(WebSocket::DataType::TEXT, "h=40", 4); // same packet
+   * @endcode
+   * @param buffer Has to outlive the endpoint, nullptr disables combining
+   * (after writing pending frames). Frames larger than size are written
+   * directly.
+   * @param maxDelay Time (in milliseconds) frames may wait for more,
+   * 0 = until the next listen().
+   */
+  void setWriteBuffer(char *buffer, uint16_t size, uint16_t maxDelay = 0);
+  /** @brief Writes combined frames now. */
+  void flush();
+
   /**
    * @brief Sets the close event handler.
    * @code{.cpp}
@@ -252,42 +379,137 @@ public:
    * @endcode
    */
   void onMessage(const onMessageCallback &);
+  /**
+   * @return Callback given to onMessage() (nullptr if none), e.g. to put it
+   * back after a temporary one.
+   */
+  onMessageCallback getOnMessage() const;
 
   void onPing(const onPingCallback &);
+  /**
+   * @brief Sets the pong handler.
+   * @code{.cpp}
+   * ws.onPong([](WebSocket &ws, const char *message, uint16_t length,
+   *            uint32_t rtt) {
+   *   if (rtt > 0) {
+   *     // rtt of this ping, ws.getRTT() for smoothed value
+   *   }
+   * });
+   * @endcode
+   */
+  void onPong(const onPongCallback &);
+
+  /**
+   * @brief Attaches application state to the endpoint, so callbacks can reach
+   * it without searching.
+   * @code{.cpp}
+   * ws.setUserData(&players[i]);
+   * ws.onMessage([](WebSocket &ws, const WebSocket::DataType dataType,
+   *               const char *message, uint16_t length) {
+   *   auto player = ws.getUserData<Player>();
+   *   // ...
+   * });
+   * @endcode
+   * @see WebSocketServerBase::onConnection
+   */
+  void setUserData(void *userData);
+  /** @return Pointer given to setUserData() (nullptr by default). */
+  void *getUserData() const;
+  /**
+   * @brief Called by the destructor of every endpoint, lets layers built on
+   * top of the library (e.g. CoroutineScheduler) drop their references to
+   * it. There is a single hook, nullptr removes it.
+   */
+  static void setDestroyHook(const onDestroyCallback &callback);
+  /** @return Pointer given to setUserData(), cast to T. */
+  template <typename T> T *getUserData() const {
+    return static_cast<T *>(m_userData);
+  }
+
+#ifdef _TRAFFIC_STATS
+  /** @return Snapshot of the traffic counters. */
+  WebSocketStats getStats() const;
+  void resetStats();
+#endif
 
 protected:
-  /** @remark Reserved for WebSocketClient. */
-  WebSocket() = default;
+  /**
+   * @remark Reserved for WebSocketClient.
+   * @param buffer Frame payload storage, owned by the derived class.
+   */
+  WebSocket(char *buffer, uint16_t bufferSize);
   /** @remark Reserved for WebSocketServer. */
-  WebSocket(const NetClient &, const char *protocol);
+  WebSocket(const NetClient &, const char *protocol, char *buffer,
+    uint16_t bufferSize);
 
   /** @cond */
   int32_t _read();
   bool _read(char *buffer, size_t size, size_t offset = 0);
+  /// Appends to the write buffer if enabled, writes to the client otherwise
+  void _write(const char *data, uint16_t length);
+  /// Flushes the write buffer if its oldest frame waited long enough
+  void _flushIfDue();
 
-  void _send(
-    uint8_t opcode, bool fin, bool mask, const char *data, uint16_t length);
+  /// Role specific, frames sent by a client are masked
+  virtual void _send(
+    uint8_t opcode, bool fin, const char *data, uint16_t length) = 0;
+  void _sendUnmasked(
+    uint8_t opcode, bool fin, const char *data, uint16_t length);
 
   void _readFrame();
   bool _readHeader(header_t &);
-  bool _readData(const header_t &, char *payload, size_t offset = 0);
+  /**
+   * Role specific, frames received by a server must be masked and by a client
+   * must not be (connection is closed otherwise).
+   */
+  virtual bool _readData(const header_t &, char *payload) = 0;
+  bool _readMaskedData(const header_t &, char *payload);
 
+  uint16_t _maxMessageSize() const;
+  /// @return false if the frame can't be read (yet)
+  bool _reserveBuffer(const header_t &);
   void _clearDataBuffer();
 
   void _handleContinuationFrame(const header_t &);
   void _handleDataFrame(const header_t &);
   void _handleCloseFrame(const header_t &, const char *payload);
+  /// Sends a close frame with given payload (code + reason), see close()
+  void _close(const char *payload, uint16_t payloadLength, const CloseCode,
+    bool instant, const char *reason, uint16_t length);
+  void _dispatchMessage(const DataType, const char *message, uint16_t length);
+  /// @return Round trip time, 0 if the pong doesn't answer ping()
+  uint32_t _handlePongFrame(const char *payload, uint16_t length);
+  /// New connection, forgets round trip time of the previous one
+  void _resetPingState();
+
+  /// Closes the connection because the endpoint violated the protocol
+  void _fail(const CloseCode);
+  void _setReadyState(const ReadyState);
   /** @endcond */
 protected:
   mutable NetClient m_client;
   ReadyState m_readyState{ReadyState::CLOSED};
-  char *m_protocol{nullptr};
+  /// Points into the protocol table of the server/client (not owned)
+  const char *m_protocol{nullptr};
+  /// Entry of the route table of the server (not owned)
+  const Route *m_route{nullptr};
+  uint32_t m_id{0};
+
+  /// Points to m_ownBuffer or to a buffer borrowed from m_bufferPool
+  char *m_dataBuffer{nullptr};
+  uint16_t m_bufferSize{0};
+  uint16_t m_currentOffset{0};
 
-  /** @note A client endpoint must always mask frames. */
-  bool m_maskEnabled{true};
+  char *m_ownBuffer{nullptr};
+  uint16_t m_ownBufferSize{0};
+  MessageBufferPool *m_bufferPool{nullptr};
+  /// Header of a frame waiting for a pool buffer (ExhaustionPolicy::WAIT)
+  header_t m_pendingHeader{};
+  bool m_framePending{false};
+  uint32_t m_waitStart{0};
+  /// Bytes read so far (wraps), for per-call quotas of listen()
+  uint32_t m_bytesRead{0};
 
-  char m_dataBuffer[kBufferMaxSize]{};
-  uint16_t m_currentOffset{0};
   /// Indicates an opcode (text/binary) that should be continued by continuation
   /// frame.
   int8_t m_tbcOpcode{-1};
@@ -295,13 +517,93 @@ protected:
   onCloseCallback _onClose{nullptr};
   onMessageCallback _onMessage{nullptr};
   onPingCallback _onPing{nullptr};
+  onPongCallback _onPong{nullptr};
+
+  /// Sequence number of the last ping() without payload
+  uint16_t m_pingSequence{0};
+  uint32_t m_smoothedRTT{0};
+  uint32_t m_rttVariance{0};
+  uint32_t m_lastSeen{0};
+
+  void *m_userData{nullptr};
+  static onDestroyCallback s_onDestroy;
+
+  char *m_writeBuffer{nullptr};
+  uint16_t m_writeBufferSize{0};
+  uint16_t m_writeBufferUsed{0};
+  uint16_t m_writeDelay{0};
+  /// Time (millis()) the oldest frame in the write buffer was added
+  uint32_t m_writeTime{0};
+
+#ifdef _TRAFFIC_STATS
+  WebSocketStats m_stats;
+#endif
+#ifdef _LATENCY_HISTOGRAMS
+  /// Histograms of the server/client (not owned)
+  LatencyHistograms *m_histograms{nullptr};
+  /// Time spent in onMessage during the current _readFrame()
+  uint32_t m_dispatchTime{0};
+#endif
+};
+
+/**
+ * @class BasicWebSocket
+ * @brief Server side endpoint with a data buffer of BufferSize bytes.
+ * @remark Created by WebSocketServer, see BasicWebSocketServer.
+ */
+template <uint16_t BufferSize> class BasicWebSocket final : public WebSocket {
+  template <uint8_t, uint16_t> friend class BasicWebSocketServer;
+
+private:
+  BasicWebSocket(const NetClient &client, const char *protocol)
+    : WebSocket{client, protocol, m_buffer, BufferSize} {}
+
+  void _send(
+    uint8_t opcode, bool fin, const char *data, uint16_t length) override {
+    _sendUnmasked(opcode, fin, data, length);
+  }
+  bool _readData(const header_t &header, char *payload) override {
+    return _readMaskedData(header, payload);
+  }
+
+private:
+  char m_buffer[BufferSize]{};
 };
 
 /** @cond */
+/** Masked frame with 16-bit extended payload length. */
+constexpr uint8_t kMaxFrameHeaderSize{8};
+/** Close, ping and pong frames can't carry more (RFC 6455, 5.5). */
+constexpr uint8_t kMaxControlPayloadSize{125};
+/** Ping payload of ping(): sequence number (2) + micros() (4). */
+constexpr uint8_t kPingStampSize{6};
+/** Pongs answering older pings are not measured. */
+constexpr uint8_t kMaxPingsInFlight{8};
+
+/**
+ * @param[out] output Array of kMaxFrameHeaderSize elements.
+ * @param maskingKey nullptr for unmasked frames.
+ * @return Header length.
+ */
+uint8_t encodeFrameHeader(char output[], uint8_t opcode, bool fin,
+  uint16_t length, const char *maskingKey);
+
+bool isValidUTF8(const byte *s, size_t length);
+
+#ifdef _TRAFFIC_STATS
+void countFrame(
+  WebSocketStats::Counter counters[], uint8_t opcode, uint32_t length);
+#endif
+
+/** @return Entry of the table equal to name, or nullptr. */
+const char *findProtocol(
+  const char *const protocols[], uint8_t count, const char *name);
+
 constexpr uint8_t kValidUpgradeHeader{0x01};
 constexpr uint8_t kValidConnectionHeader{0x02};
 constexpr uint8_t kValidSecKey{0x04};
 constexpr uint8_t kValidVersion{0x08};
+constexpr uint8_t kAcceptsGzip{0x10};
 /** @endcond */
 
 } // namespace net
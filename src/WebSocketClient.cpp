@@ -5,12 +5,20 @@
 
 #define _TRIGGER_ERROR(code)                                                   \
   {                                                                            \
-    terminate();                                                               \
+    __trace(TraceEvent::HANDSHAKE, this,                                       \
+      static_cast<uint8_t>(m_handshakeStep), 0, static_cast<uint16_t>(code));  \
+    _recordFailure();                                                          \
+    _terminate();                                                              \
     if (_onError) _onError(code);                                              \
+    if (_onErrorWithContext) _onErrorWithContext(code, m_errorContext);        \
   }
 
 namespace net {
 
+constexpr uint8_t kNoEndpoint{0xFF};
+/** Masked payload is written in pieces of that size (multiple of 4). */
+constexpr uint8_t kMaskChunkSize{32};
+
 /**
  * @brief Generates Sec-WebSocket-Key value.
  * @param[out] output Array of 25 elements (with one for NULL).
@@ -26,59 +34,592 @@ void generateSecKey(char output[]) {
   base64_encode(output, temp, kLength);
 }
 
+/**
+ * @param protocols Comma separated list (as given to open()).
+ * @return Whether the list contains the given name.
+ */
+bool hasProtocol(const char *protocols, const char *name) {
+  const auto length = strlen(name);
+  while (*protocols) {
+    protocols += strspn(protocols, " ,");
+    const auto itemLength = strcspn(protocols, " ,");
+    if (itemLength == length && strncmp(protocols, name, length) == 0)
+      return true;
+    protocols += itemLength;
+  }
+  return false;
+}
+
+void generateMask(char output[]) {
+  randomSeed(analogRead(A0));
+  for (byte i = 0; i < 4; ++i)
+    output[i] = static_cast<char>(random(0xFF));
+}
+void applyMask(char *data, uint16_t length, const char maskingKey[]) {
+  for (uint16_t i = 0; i < length; ++i)
+    data[i] ^= maskingKey[i % 4];
+}
+
 //
 // WebSocketClient implementation (public):
 //
 
-bool WebSocketClient::open(const char *host, uint16_t port, const char *path,
-  const char *supportedProtocols) {
-  close(GOING_AWAY, true); // Close if already open
+WebSocketClientBase::WebSocketClientBase(char *buffer, uint16_t bufferSize)
+  : WebSocket{buffer, bufferSize} {
+  __measureLatency(m_histograms = &m_latency);
+}
 
-  if (!m_client.connect(host, port)) {
-    __debugOutput(
-      F("Error in connection establishment: net::ERR_CONNECTION_REFUSED\n"));
-    _TRIGGER_ERROR(WebSocketError::CONNECTION_REFUSED);
-    return false;
+bool WebSocketClientBase::open(const char *host, uint16_t port,
+  const char *path, const char *supportedProtocols) {
+  m_defaultEndpoint = Endpoint{host, port, path, 0, 0};
+  return open(&m_defaultEndpoint, 1, supportedProtocols);
+}
+void WebSocketClientBase::openAsync(const char *host, uint16_t port,
+  const char *path, const char *supportedProtocols) {
+  m_defaultEndpoint = Endpoint{host, port, path, 0, 0};
+  openAsync(&m_defaultEndpoint, 1, supportedProtocols);
+}
+bool WebSocketClientBase::open(
+  Endpoint endpoints[], uint8_t count, const char *supportedProtocols) {
+  openAsync(endpoints, count, supportedProtocols);
+  while (!_waitForOpen()) {
+    // Move on to a server that did not fail yet (if any)
+    const auto next = _pickEndpoint(kNoEndpoint);
+    if (!m_autoReconnect || next == kNoEndpoint ||
+        m_endpoints[next].failures > 0)
+      return false;
+
+    _connectTo(next);
   }
 
-  char secKey[25]{};
-  generateSecKey(secKey);
-  _sendRequest(host, port, path, secKey, supportedProtocols);
+  return true;
+}
+void WebSocketClientBase::openAsync(
+  Endpoint endpoints[], uint8_t count, const char *supportedProtocols) {
+  close(GOING_AWAY, true); // Close if already open (or connecting)
 
-  m_readyState = ReadyState::CONNECTING;
-  if (!_waitForResponse(kTimeoutInterval)) {
-    __debugOutput(
-      F("Error in connection establishment: net::ERR_CONNECTION_TIMED_OUT\n"));
-    _TRIGGER_ERROR(WebSocketError::REQUEST_TIMEOUT);
-    return false;
+  m_endpoints = endpoints;
+  m_endpointCount = count;
+  m_supportedProtocols = supportedProtocols;
+
+  m_autoReconnect = true;
+  m_reconnectScheduled = false;
+  m_reconnectAttempts = 0;
+
+  const auto first = _pickEndpoint(kNoEndpoint);
+  if (first != kNoEndpoint) _connectTo(first);
+}
+void WebSocketClientBase::close(
+  const CloseCode code, bool instant, const char *reason, uint16_t length) {
+  m_autoReconnect = false;
+  m_reconnectScheduled = false;
+  m_sendQueueUsed = 0;
+  if (m_standby) {
+    m_standby->close(GOING_AWAY, true);
+    m_standby->terminate();
   }
+  // There is nothing to close yet, abandon the handshake (onOpen won't fire)
+  if (m_readyState == ReadyState::CONNECTING) {
+    _terminate();
+    return;
+  }
+  WebSocket::close(code, instant, reason, length);
+}
+void WebSocketClientBase::terminate() {
+  m_autoReconnect = false;
+  m_reconnectScheduled = false;
+  m_sendQueueUsed = 0;
+  if (m_standby) m_standby->terminate();
+  _terminate();
+}
 
-  if (!_readResponse(secKey)) return false;
+void WebSocketClientBase::setReconnectPolicy(const ReconnectPolicy &policy) {
+  m_reconnectPolicy = policy;
+  m_reconnectEnabled = true;
+}
+void WebSocketClientBase::disableReconnect() {
+  m_reconnectEnabled = false;
+  m_reconnectScheduled = false;
+}
+uint16_t WebSocketClientBase::getReconnectCount() const {
+  return m_reconnectCount;
+}
 
-  m_readyState = ReadyState::OPEN;
-  if (_onOpen) _onOpen(*this);
+void WebSocketClientBase::setProtocols(
+  const char *const protocols[], uint8_t count) {
+  m_protocols = protocols;
+  m_protocolCount = count;
+}
+
+void WebSocketClientBase::setStandby(WebSocketClientBase *standby) {
+  if (m_standby) m_standby->terminate();
+  m_standby = standby;
+}
+const WebSocketClientBase::Endpoint &WebSocketClientBase::getEndpoint() const {
+  return m_endpoints ? m_endpoints[m_currentEndpoint] : m_defaultEndpoint;
+}
+
+void WebSocketClientBase::setSendQueue(
+  char *buffer, uint16_t size, OverflowPolicy overflowPolicy) {
+  m_sendQueue = buffer;
+  m_sendQueueSize = buffer ? size : 0;
+  m_sendQueueUsed = 0;
+  m_overflowPolicy = overflowPolicy;
+}
+
+bool WebSocketClientBase::send(
+  const DataType dataType, const char *message, uint16_t length) {
+  if (m_readyState != ReadyState::OPEN && m_sendQueue &&
+      _isConnectionPending()) {
+    const uint8_t opcode{
+      dataType == DataType::TEXT ? TEXT_FRAME : BINARY_FRAME};
+    if (_enqueue(opcode, message, length)) return true;
+
+    if (m_overflowPolicy != OverflowPolicy::BLOCK ||
+        m_readyState != ReadyState::CONNECTING)
+      return false;
+
+    _waitForOpen();
+  }
+
+  if (m_readyState != ReadyState::OPEN) {
+    // #TODO Trigger error ...
+    return false;
+  }
+
+  WebSocket::send(dataType, message, length);
   return true;
 }
-void WebSocketClient::terminate() { WebSocket::terminate(); }
 
-void WebSocketClient::listen() {
+void WebSocketClientBase::listen() {
+  __measureLatency(const uint32_t startTime{clockMicros()});
+  _poll();
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  if (m_postQueue && m_readyState == ReadyState::OPEN) _drainPostQueue();
+#endif
+  _flushIfDue();
+  __measureLatency(m_latency.loop.record(clockMicros() - startTime));
+}
+void WebSocketClientBase::setMaxFramesPerListen(uint8_t count) {
+  m_maxFramesPerListen = count;
+}
+void WebSocketClientBase::setListenTimeBudget(uint32_t duration) {
+  m_listenTimeBudget = duration;
+}
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+void WebSocketClientBase::setPostQueue(PostQueue *queue) {
+  m_postQueue = queue;
+}
+#endif
+
+#ifdef _LATENCY_HISTOGRAMS
+LatencyHistograms &WebSocketClientBase::getHistograms() { return m_latency; }
+#endif
+
+void WebSocketClientBase::onOpen(const onOpenCallback &callback) {
+  _onOpen = callback;
+}
+void WebSocketClientBase::onError(const onErrorCallback &callback) {
+  _onError = callback;
+  _onErrorWithContext = nullptr;
+}
+void WebSocketClientBase::onError(
+  const onErrorContextCallback &callback, void *context) {
+  _onError = nullptr;
+  _onErrorWithContext = callback;
+  m_errorContext = context;
+}
+
+//
+// Private:
+//
+
+void WebSocketClientBase::_send(
+  uint8_t opcode, bool fin, const char *data, uint16_t length) {
+  __measureLatency(const uint32_t startTime{clockMicros()});
+
+  char maskingKey[4]{};
+  generateMask(maskingKey);
+
+  // Header goes out in a single write
+  char header[kMaxFrameHeaderSize]{};
+  const auto headerSize =
+    encodeFrameHeader(header, opcode, fin, length, maskingKey);
+  _write(header, headerSize);
+
+  char chunk[kMaskChunkSize];
+  for (uint16_t i = 0; i < length; i += kMaskChunkSize) {
+    const uint16_t chunkSize =
+      length - i < kMaskChunkSize ? length - i : kMaskChunkSize;
+    memcpy(chunk, &data[i], chunkSize);
+    applyMask(chunk, chunkSize, maskingKey);
+    _write(chunk, chunkSize);
+  }
+
+  __trace(TraceEvent::FRAME_TX, this, opcode,
+    (fin ? kTraceFin : 0) | kTraceMask, length);
+  __updateStats(countFrame(m_stats.out, opcode, length));
+  __measureLatency(m_latency.write.record(clockMicros() - startTime));
+}
+bool WebSocketClientBase::_readData(const header_t &header, char *payload) {
+  if (header.mask) {
+    __debugOutput(F("Server frames must not be masked!\n"));
+    _fail(PROTOCOL_ERROR);
+    return false;
+  }
+
+  return _read(payload, header.length);
+}
+
+void WebSocketClientBase::_poll() {
+  if (m_standby) _maintainStandby();
+
+  switch (m_readyState) {
+  case ReadyState::CONNECTING:
+    return _continueHandshake();
+  case ReadyState::CLOSED:
+    return _continueReconnect();
+  default:
+    break;
+  }
+
   if (!m_client.connected()) {
     if (m_readyState == ReadyState::OPEN) {
-      terminate();
+      _recordFailure();
+      _terminate();
       if (_onClose) _onClose(*this, ABNORMAL_CLOSURE, nullptr, 0);
     }
     return;
   }
 
-  if (m_client.available()) _readFrame();
+  if (m_reconnectAttempts > 0 &&
+      clockMillis() - m_stateTime >= m_reconnectPolicy.stableInterval) {
+    m_reconnectAttempts = 0;
+  }
+
+  // Drain frames that are already there (and those arriving meanwhile), a
+  // burst arrives within one call
+  const uint32_t startTime{clockMicros()};
+  for (uint8_t i = 0; !m_maxFramesPerListen || i < m_maxFramesPerListen; ++i) {
+    if (m_client.available() <= 0) break;
+    if (m_listenTimeBudget && clockMicros() - startTime >= m_listenTimeBudget)
+      break;
+
+    _readFrame();
+    // Closed or frame left unread (waiting for a pool buffer)
+    if (m_readyState == ReadyState::CLOSED || m_framePending) break;
+  }
 }
 
-void WebSocketClient::onOpen(const onOpenCallback &callback) {
-  _onOpen = callback;
+void WebSocketClientBase::_terminate() {
+  m_handshakeStep = HandshakeStep::NONE;
+  WebSocket::terminate();
 }
-void WebSocketClient::onError(const onErrorCallback &callback) {
-  _onError = callback;
+void WebSocketClientBase::_recordFailure() {
+  auto &endpoint = m_endpoints[m_currentEndpoint];
+  if (endpoint.failures < 0xFF) ++endpoint.failures;
+  m_stateTime = clockMillis();
+}
+
+void WebSocketClientBase::_beginHandshake() {
+  generateSecKey(m_secKey);
+  m_handshakeFlags = 0;
+  m_responseLine = 0;
+  _clearDataBuffer();
+  _resetPingState();
+
+  m_handshakeStep = HandshakeStep::CONNECT;
+  _setReadyState(ReadyState::CONNECTING);
+  __trace(TraceEvent::HANDSHAKE, this,
+    static_cast<uint8_t>(HandshakeStep::CONNECT), 0, 0);
 }
+void WebSocketClientBase::_continueHandshake() {
+  switch (m_handshakeStep) {
+  case HandshakeStep::CONNECT: {
+    auto &endpoint = m_endpoints[m_currentEndpoint];
+    const auto startTime = clockMillis();
+    if (!m_client.connect(endpoint.host, endpoint.port)) {
+      __debugOutput(
+        F("Error in connection establishment: net::ERR_CONNECTION_REFUSED\n"));
+      _TRIGGER_ERROR(WebSocketError::CONNECTION_REFUSED);
+      return;
+    }
+
+    _sendRequest();
+    m_stateTime = clockMillis();
+    // Response time is added when the connection opens
+    endpoint.latency = m_stateTime - startTime;
+    m_handshakeStep = HandshakeStep::READ_RESPONSE;
+    __trace(TraceEvent::HANDSHAKE, this,
+      static_cast<uint8_t>(HandshakeStep::READ_RESPONSE), 0, 0);
+    break;
+  }
+  case HandshakeStep::READ_RESPONSE: {
+    if (_readResponse()) {
+      m_handshakeStep = HandshakeStep::NONE;
+      _clearDataBuffer();
+
+      auto &endpoint = m_endpoints[m_currentEndpoint];
+      endpoint.latency += clockMillis() - m_stateTime;
+      endpoint.failures = 0;
+
+      __trace(TraceEvent::HANDSHAKE, this,
+        static_cast<uint8_t>(HandshakeStep::READ_RESPONSE), 0, 101);
+      _setReadyState(ReadyState::OPEN);
+      m_stateTime = clockMillis();
+      // Queued messages go first, before anything sent from onOpen
+      _flushSendQueue();
+      if (_onOpen) _onOpen(*this);
+    } else if (m_handshakeStep == HandshakeStep::READ_RESPONSE) {
+      if (!m_client.connected()) {
+        __debugOutput(
+          F("Error in connection establishment: net::ERR_CONNECTION_CLOSED\n"));
+        _TRIGGER_ERROR(WebSocketError::CONNECTION_ERROR);
+      } else if (clockMillis() - m_stateTime >= kTimeoutInterval) {
+        __debugOutput(F(
+          "Error in connection establishment: net::ERR_CONNECTION_TIMED_OUT\n"));
+        _TRIGGER_ERROR(WebSocketError::REQUEST_TIMEOUT);
+      }
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+bool WebSocketClientBase::_waitForOpen() {
+  while (m_readyState == ReadyState::CONNECTING) {
+    _continueHandshake();
+    if (m_readyState == ReadyState::CONNECTING && !m_client.available())
+      clockDelay(1);
+  }
+
+  return m_readyState == ReadyState::OPEN;
+}
+
+void WebSocketClientBase::_continueReconnect() {
+  if (!m_autoReconnect) return;
+  if (_promoteStandby()) return;
+
+  if (!m_reconnectScheduled) {
+    if (m_reconnectPolicy.maxAttempts > 0 &&
+        m_reconnectAttempts >= m_reconnectPolicy.maxAttempts) {
+      __debugOutput(F("Giving up reconnection after %u attempts\n"),
+        m_reconnectAttempts);
+      m_autoReconnect = false;
+      m_sendQueueUsed = 0;
+      return;
+    }
+
+    // Leave the server the standby is connecting to alone
+    const uint8_t busy{
+      m_standby && m_standby->m_readyState != ReadyState::CLOSED
+        ? m_standby->m_currentEndpoint
+        : kNoEndpoint};
+
+    // Another server that has not failed yet is tried right away (failover),
+    // otherwise the reconnect policy applies
+    uint8_t next{_pickEndpoint(m_currentEndpoint)};
+    if (next != kNoEndpoint && next != busy &&
+        m_endpoints[next].failures == 0) {
+      m_reconnectDelay = 0;
+    } else {
+      if (!m_reconnectEnabled) return;
+      next = _pickEndpoint(busy);
+      if (next == kNoEndpoint) return;
+      m_reconnectDelay = _backoffDelay(m_reconnectAttempts + 1);
+    }
+
+    m_currentEndpoint = next;
+    m_stateTime = clockMillis();
+    m_reconnectScheduled = true;
+    return;
+  }
+
+  if (clockMillis() - m_stateTime < m_reconnectDelay) return;
+
+  m_reconnectScheduled = false;
+  if (m_reconnectAttempts < 0xFF) ++m_reconnectAttempts;
+  ++m_reconnectCount;
+  __debugOutput(F("Reconnecting to %s:%u (attempt #%u)\n"),
+    m_endpoints[m_currentEndpoint].host, m_endpoints[m_currentEndpoint].port,
+    m_reconnectAttempts);
+  _beginHandshake();
+}
+uint32_t WebSocketClientBase::_backoffDelay(uint8_t attempts) const {
+  if (attempts == 0) return 0;
+
+  // initialDelay * 2^(attempts - 1), capped at maxDelay
+  uint32_t backoff{m_reconnectPolicy.initialDelay};
+  for (uint8_t i = 1; i < attempts && backoff < m_reconnectPolicy.maxDelay; ++i)
+    backoff <<= 1;
+  if (backoff > m_reconnectPolicy.maxDelay)
+    backoff = m_reconnectPolicy.maxDelay;
+
+  // "Full jitter", spreads reconnecting clients uniformly over the window
+  return m_reconnectPolicy.jitter ? static_cast<uint32_t>(random(backoff + 1))
+                                  : backoff;
+}
+
+uint8_t WebSocketClientBase::_pickEndpoint(uint8_t excluded) const {
+  // The fewest consecutive failures wins, ties go to the earlier entry
+  uint8_t best{kNoEndpoint};
+  for (uint8_t i = 0; i < m_endpointCount; ++i) {
+    if (i == excluded) continue;
+    if (best == kNoEndpoint ||
+        m_endpoints[i].failures < m_endpoints[best].failures)
+      best = i;
+  }
+  return best;
+}
+void WebSocketClientBase::_connectTo(uint8_t endpoint) {
+  m_currentEndpoint = endpoint;
+  _beginHandshake();
+}
+void WebSocketClientBase::_maintainStandby() {
+  auto &standby = *m_standby;
+  standby.listen();
+  // The spare connection is (re)established only next to a working one
+  if (m_readyState != ReadyState::OPEN ||
+      standby.m_readyState != ReadyState::CLOSED)
+    return;
+
+  if (!standby.m_reconnectScheduled) {
+    const auto next = _pickEndpoint(m_currentEndpoint);
+    if (next == kNoEndpoint) return;
+
+    standby.m_currentEndpoint = next;
+    standby.m_reconnectDelay = _backoffDelay(m_endpoints[next].failures);
+    standby.m_stateTime = clockMillis();
+    standby.m_reconnectScheduled = true;
+    return;
+  }
+
+  if (clockMillis() - standby.m_stateTime < standby.m_reconnectDelay) return;
+
+  standby.m_reconnectScheduled = false;
+  standby.m_endpoints = m_endpoints;
+  standby.m_endpointCount = m_endpointCount;
+  standby.m_supportedProtocols = m_supportedProtocols;
+  standby.m_protocols = m_protocols;
+  standby.m_protocolCount = m_protocolCount;
+  standby._beginHandshake();
+}
+bool WebSocketClientBase::_promoteStandby() {
+  if (!m_standby || m_standby->m_readyState != ReadyState::OPEN) return false;
+
+  auto &standby = *m_standby;
+  __debugOutput(F("Switching to standby connection %s:%u\n"),
+    m_endpoints[standby.m_currentEndpoint].host,
+    m_endpoints[standby.m_currentEndpoint].port);
+
+  const NetClient client{m_client};
+  m_client = standby.m_client;
+  standby.m_client = client;
+
+  if (standby.m_protocol == standby.m_protocolName) {
+    strcpy(m_protocolName, standby.m_protocolName);
+    m_protocol = m_protocolName;
+  } else {
+    m_protocol = standby.m_protocol;
+  }
+
+  m_currentEndpoint = standby.m_currentEndpoint;
+  standby._terminate(); // Now holds the dead connection
+  _clearDataBuffer();
+  _resetPingState();
+
+  m_reconnectScheduled = false;
+  _setReadyState(ReadyState::OPEN);
+  m_stateTime = clockMillis();
+  _flushSendQueue();
+  if (_onOpen) _onOpen(*this);
+  return true;
+}
+
+bool WebSocketClientBase::_isConnectionPending() const {
+  return m_readyState == ReadyState::CONNECTING ||
+         (m_readyState == ReadyState::CLOSED && m_reconnectEnabled &&
+           m_autoReconnect);
+}
+bool WebSocketClientBase::_enqueue(
+  uint8_t opcode, const char *message, uint16_t length) {
+  const uint32_t recordSize{kMaxFrameHeaderSize + uint32_t{length}};
+  if (recordSize > m_sendQueueSize) return false;
+
+  while (m_sendQueueUsed + recordSize > m_sendQueueSize) {
+    if (m_overflowPolicy != OverflowPolicy::DROP_OLDEST) return false;
+    _dropOldestMessage();
+  }
+
+  char *record{&m_sendQueue[m_sendQueueUsed]};
+  record[0] = opcode;
+  record[1] = static_cast<char>(length >> 8);
+  record[2] = static_cast<char>(length & 0xFF);
+  memcpy(&record[kMaxFrameHeaderSize], message, length);
+  m_sendQueueUsed += recordSize;
+#ifdef _TRAFFIC_STATS
+  if (m_sendQueueUsed > m_stats.sendQueueHighWater)
+    m_stats.sendQueueHighWater = m_sendQueueUsed;
+#endif
+  return true;
+}
+void WebSocketClientBase::_dropOldestMessage() {
+  const uint16_t length = (static_cast<uint8_t>(m_sendQueue[1]) << 8) |
+                          static_cast<uint8_t>(m_sendQueue[2]);
+  const uint16_t recordSize = kMaxFrameHeaderSize + length;
+  m_sendQueueUsed -= recordSize;
+  memmove(m_sendQueue, &m_sendQueue[recordSize], m_sendQueueUsed);
+}
+void WebSocketClientBase::_flushSendQueue() {
+  if (m_sendQueueUsed == 0) return;
+  __measureLatency(const uint32_t startTime{clockMicros()});
+
+  // A frame is never longer than its record (the payload moves left or stays),
+  // so frames are built in place and sent with a single write.
+  uint16_t in{0};
+  uint16_t out{0};
+  while (in < m_sendQueueUsed) {
+    const uint8_t opcode = m_sendQueue[in];
+    const uint16_t length = (static_cast<uint8_t>(m_sendQueue[in + 1]) << 8) |
+                            static_cast<uint8_t>(m_sendQueue[in + 2]);
+
+    char maskingKey[4]{};
+    generateMask(maskingKey);
+    char header[kMaxFrameHeaderSize]{};
+    const auto headerSize =
+      encodeFrameHeader(header, opcode, true, length, maskingKey);
+
+    char *frame{&m_sendQueue[out]};
+    memmove(&frame[headerSize], &m_sendQueue[in + kMaxFrameHeaderSize], length);
+    memcpy(frame, header, headerSize);
+    applyMask(&frame[headerSize], length, maskingKey);
+    __trace(TraceEvent::FRAME_TX, this, opcode, kTraceFin | kTraceMask, length);
+    __updateStats(countFrame(m_stats.out, opcode, length));
+
+    in += kMaxFrameHeaderSize + length;
+    out += headerSize + length;
+  }
+
+  _write(m_sendQueue, out);
+  m_sendQueueUsed = 0;
+  __measureLatency(m_latency.write.record(clockMicros() - startTime));
+}
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+void WebSocketClientBase::_drainPostQueue() {
+  for (uint16_t i = 0; i <= m_postQueue->m_mask; ++i) {
+    const auto message = m_postQueue->_front();
+    if (!message) break;
+
+    // Posted to a connection of a server, a client has nowhere to send it
+    if (!message->target) {
+      WebSocket::send(
+        message->dataType, PostQueue::_payload(message), message->length);
+    }
+    m_postQueue->_pop();
+  }
+}
+#endif
 
 //
 // Send request (client handshake):
@@ -91,40 +632,41 @@ void WebSocketClient::onError(const onErrorCallback &callback) {
 // [6] Sec-WebSocket-Version: 13
 // [7]
 //
-void WebSocketClient::_sendRequest(const char *host, uint16_t port,
-  const char *path, const char *secKey, const char *supportedProtocols) {
+void WebSocketClientBase::_sendRequest() {
   char buffer[128]{};
 
-  snprintf_P(buffer, sizeof(buffer), (PGM_P)F("GET %s HTTP/1.1"), path);
+  const auto &endpoint = m_endpoints[m_currentEndpoint];
+  snprintf_P(
+    buffer, sizeof(buffer), (PGM_P)F("GET %s HTTP/1.1"), endpoint.path);
   m_client.println(buffer);
 
-  snprintf_P(buffer, sizeof(buffer), (PGM_P)F("Host: %s:%u"), host, port);
+  snprintf_P(buffer, sizeof(buffer), (PGM_P)F("Host: %s:%u"), endpoint.host,
+    endpoint.port);
   m_client.println(buffer);
 
   m_client.println(F("Upgrade: websocket"));
   m_client.println(F("Connection: Upgrade"));
 
-  snprintf_P(buffer, sizeof(buffer), (PGM_P)F("Sec-WebSocket-Key: %s"), secKey);
+  snprintf_P(
+    buffer, sizeof(buffer), (PGM_P)F("Sec-WebSocket-Key: %s"), m_secKey);
   m_client.println(buffer);
 
-  if (supportedProtocols) {
+  if (m_supportedProtocols) {
     snprintf_P(buffer, sizeof(buffer), (PGM_P)F("Sec-WebSocket-Protocol: %s"),
-      supportedProtocols);
+      m_supportedProtocols);
     m_client.println(buffer);
+  } else if (m_protocolCount > 0) {
+    m_client.print(F("Sec-WebSocket-Protocol: "));
+    for (uint8_t i = 0; i < m_protocolCount; ++i) {
+      if (i > 0) m_client.print(F(", "));
+      m_client.print(m_protocols[i]);
+    }
+    m_client.println();
   }
   m_client.println(F("Sec-WebSocket-Version: 13\r\n"));
 
   m_client.flush();
 }
-bool WebSocketClient::_waitForResponse(uint16_t maxAttempts, uint8_t time) {
-  uint16_t attempts{0};
-  while (!m_client.available() && attempts < maxAttempts) {
-    ++attempts;
-    delay(time);
-  }
-
-  return attempts < maxAttempts;
-}
 
 //
 // Read response (server-side handshake):
@@ -135,128 +677,142 @@ bool WebSocketClient::_waitForResponse(uint16_t maxAttempts, uint8_t time) {
 // [4] Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=
 // [5]
 //
-bool WebSocketClient::_readResponse(const char *secKey) {
-  uint8_t flags{0};
+// Consumes whatever is available without waiting for more, the current line
+// is assembled in m_dataBuffer (unused until the connection is open, at least
+// 64 bytes, see BasicWebSocketClient).
+//
+bool WebSocketClientBase::_readResponse() {
+  while (m_client.available()) {
+    const auto bite = static_cast<char>(m_client.read());
+    if (bite != '\n') {
+      // Longer lines are truncated, the required headers fit in 64 bytes
+      if (m_currentOffset < m_bufferSize - 1)
+        m_dataBuffer[m_currentOffset++] = bite;
+      continue;
+    }
 
-  int32_t bite{-1};
-  byte currentLine{0};
-  byte counter{0};
+    char *line{m_dataBuffer};
+    line[m_currentOffset] = '\0';
+    line[strcspn(line, "\r")] = '\0';
 
-  char buffer[128]{};
+    //
+    // [5] Empty line (end of response)
+    //
 
-  while ((bite = _read()) != -1) {
-    buffer[counter++] = bite;
+    if (m_responseLine > 0 && *line == '\0')
+      return _validateHandshake(m_handshakeFlags);
 
-    if (bite == '\n') {
-      uint8_t lineBreakPos = strcspn(buffer, "\r\n");
-      buffer[lineBreakPos] = '\0';
+    if (!_handleResponseLine(line)) return false;
 
-#ifdef _DUMP_HANDSHAKE
-      printf(F("[Line #%u] %s\n"), currentLine, buffer);
-#endif
+    m_currentOffset = 0;
+    ++m_responseLine;
+  }
+
+  return false;
+}
+bool WebSocketClientBase::_handleResponseLine(char *line) {
+  if (m_responseLine == 0) {
+    if (strncmp_P(line, (PGM_P)F("HTTP/1.1 101"), 12) != 0) {
+      __debugOutput(F("Error during WebSocket handshake: "
+                      "net::ERR_INVALID_HTTP_RESPONSE\n"));
+      _TRIGGER_ERROR(WebSocketError::BAD_REQUEST);
+      return false;
+    }
+    return true;
+  }
 
-      if (currentLine == 0) {
-        if (strncmp_P(buffer, (PGM_P)F("HTTP/1.1 101"), 12) != 0) {
-          __debugOutput(F("Error during WebSocket handshake: "
-                          "net::ERR_INVALID_HTTP_RESPONSE\n"));
-          _TRIGGER_ERROR(WebSocketError::BAD_REQUEST);
-          return false;
-        }
-      } else {
-        if (lineBreakPos > 0) {
-          char *rest{buffer};
-          char *value{nullptr};
-
-          char *header{strtok_r(rest, ":", &rest)};
-
-          //
-          // [2] Upgrade header:
-          //
-
-          if (strcasecmp_P(header, (PGM_P)F("Upgrade")) == 0) {
-            value = strtok_r(rest, " ", &rest);
-            if (!value || (strcasecmp_P(value, (PGM_P)F("websocket")) != 0)) {
-              __debugOutput(F("Error during WebSocket handshake: 'Upgrade' "
-                              "header value is not 'websocket': %s\n"),
-                value);
-              _TRIGGER_ERROR(WebSocketError::UPGRADE_REQUIRED);
-              return false;
-            }
-
-            flags |= kValidUpgradeHeader;
-          }
-
-          //
-          // [3] Connection header:
-          //
-
-          else if (strcasecmp_P(header, (PGM_P)F("Connection")) == 0) {
-            value = strtok_r(rest, " ", &rest);
-            if (!value || (strcasecmp_P(value, (PGM_P)F("Upgrade")) != 0)) {
-              __debugOutput(
-                F("Error during WebSocket handshake: 'Connection' header "
-                  "value is not 'Upgrade': %s\n"),
-                value);
-              _TRIGGER_ERROR(WebSocketError::UPGRADE_REQUIRED);
-              return false;
-            }
-
-            flags |= kValidConnectionHeader;
-          }
-
-          //
-          // [4] Sec-WebSocket-Accept header:
-          //
-
-          else if (strcasecmp_P(header, (PGM_P)F("Sec-WebSocket-Accept")) ==
-                   0) {
-            value = strtok_r(rest, " ", &rest);
-
-            char encodedKey[29]{};
-            encodeSecKey(secKey, encodedKey);
-            if (!value || (strcmp(value, encodedKey) != 0)) {
-              __debugOutput(F("Error during WebSocket handshake: Incorrect "
-                              "'Sec-WebSocket-Accept' header value\n"));
-              _TRIGGER_ERROR(WebSocketError::BAD_REQUEST);
-              return false;
-            }
-
-            flags |= kValidSecKey;
-          }
-
-          //
-          // Sec-WebSocket-Protocol (optional):
-          //
-
-          else if (strcasecmp_P(header, (PGM_P)F("Sec-WebSocket-Protocol")) ==
-                   0) {
-            value = strtok_r(rest, " ", &rest);
-            m_protocol = new char[strlen(value) + 1]{};
-            strcpy(m_protocol, value);
-          }
-
-          else {
-            // don't care about other headers ...
-          }
-        }
-
-        //
-        // [5] Empty line (end of response)
-        //
-
-        else
-          break;
+  char *rest{line};
+  char *value{nullptr};
+
+  char *header{strtok_r(rest, ":", &rest)};
+
+  //
+  // [2] Upgrade header:
+  //
+
+  if (strcasecmp_P(header, (PGM_P)F("Upgrade")) == 0) {
+    value = strtok_r(rest, " ", &rest);
+    if (!value || (strcasecmp_P(value, (PGM_P)F("websocket")) != 0)) {
+      __debugOutput(F("Error during WebSocket handshake: 'Upgrade' "
+                      "header value is not 'websocket': %s\n"),
+        value);
+      _TRIGGER_ERROR(WebSocketError::UPGRADE_REQUIRED);
+      return false;
+    }
+
+    m_handshakeFlags |= kValidUpgradeHeader;
+  }
+
+  //
+  // [3] Connection header:
+  //
+
+  else if (strcasecmp_P(header, (PGM_P)F("Connection")) == 0) {
+    value = strtok_r(rest, " ", &rest);
+    if (!value || (strcasecmp_P(value, (PGM_P)F("Upgrade")) != 0)) {
+      __debugOutput(F("Error during WebSocket handshake: 'Connection' header "
+                      "value is not 'Upgrade': %s\n"),
+        value);
+      _TRIGGER_ERROR(WebSocketError::UPGRADE_REQUIRED);
+      return false;
+    }
+
+    m_handshakeFlags |= kValidConnectionHeader;
+  }
+
+  //
+  // [4] Sec-WebSocket-Accept header:
+  //
+
+  else if (strcasecmp_P(header, (PGM_P)F("Sec-WebSocket-Accept")) == 0) {
+    value = strtok_r(rest, " ", &rest);
+
+    char encodedKey[29]{};
+    encodeSecKey(m_secKey, encodedKey);
+    if (!value || (strcmp(value, encodedKey) != 0)) {
+      __debugOutput(F("Error during WebSocket handshake: Incorrect "
+                      "'Sec-WebSocket-Accept' header value\n"));
+      _TRIGGER_ERROR(WebSocketError::BAD_REQUEST);
+      return false;
+    }
+
+    m_handshakeFlags |= kValidSecKey;
+  }
+
+  //
+  // Sec-WebSocket-Protocol (optional):
+  //
+
+  else if (strcasecmp_P(header, (PGM_P)F("Sec-WebSocket-Protocol")) == 0) {
+    value = strtok_r(rest, " ", &rest);
+    if (value && m_supportedProtocols) {
+      // Same precedence as in _sendRequest()
+      if (strlen(value) < sizeof(m_protocolName) &&
+          hasProtocol(m_supportedProtocols, value)) {
+        strcpy(m_protocolName, value);
+        m_protocol = m_protocolName;
       }
+    } else if (value && m_protocolCount > 0) {
+      m_protocol = findProtocol(m_protocols, m_protocolCount, value);
+    } else {
+      return true;
+    }
 
-      memset(buffer, '\0', sizeof(buffer));
-      counter = 0;
-      ++currentLine;
+    if (!m_protocol) {
+      __debugOutput(F("Error during WebSocket handshake: Server sent a "
+                      "subprotocol that the client did not request\n"));
+      _TRIGGER_ERROR(WebSocketError::BAD_REQUEST);
+      return false;
     }
   }
 
-  return _validateHandshake(flags);
+  else {
+    // don't care about other headers ...
+  }
+
+  return true;
 }
-bool WebSocketClient::_validateHandshake(uint8_t flags) {
+bool WebSocketClientBase::_validateHandshake(uint8_t flags) {
   if (!(flags & kValidUpgradeHeader)) {
     __debugOutput(
       F("Error during WebSocket handshake: 'Upgrade' header is missing\n"));
@@ -2,32 +2,231 @@
 
 /** @file */
 
+#include "PostQueue.h"
 #include "WebSocket.h"
 
 namespace net {
 
 /**
- * @class WebSocketClient
+ * @class WebSocketClientBase
+ * @brief Client logic, independent of the data buffer size.
+ * @see BasicWebSocketClient
  */
-class WebSocketClient final : public WebSocket {
+class WebSocketClientBase : public WebSocket {
 public:
   using onOpenCallback = void (*)(WebSocket &);
   using onErrorCallback = void (*)(const WebSocketError);
+  /** @param context Given to onError(). */
+  using onErrorContextCallback = void (*)(const WebSocketError, void *context);
+
+  /**
+   * @brief Automatic reconnection settings: exponential backoff with optional
+   * "full jitter" (the delay is randomized between 0 and the backoff value, so
+   * a fleet of clients does not come back all at once).
+   */
+  struct ReconnectPolicy {
+    /** Backoff of the first attempt (in milliseconds). */
+    uint32_t initialDelay{1000};
+    /** Backoff upper limit (in milliseconds). */
+    uint32_t maxDelay{60000};
+    /** Number of consecutive failed attempts before giving up, 0 = never. */
+    uint8_t maxAttempts{0};
+    /**
+     * Connection has to stay open for that long (in milliseconds) to reset
+     * the backoff.
+     */
+    uint32_t stableInterval{10000};
+    /** Randomizes each delay within [0, backoff]. */
+    bool jitter{true};
+  };
+
+  /**
+   * @brief Server address, with statistics maintained by the client.
+   * @code{.cpp}
+   * WebSocketClient::Endpoint endpoints[]{
+   *   {"192.168.46.4", 3000, "/"},
+   *   {"192.168.46.5", 3000, "/"},
+   * };
+   * @endcode
+   */
+  struct Endpoint {
+    const char *host;
+    uint16_t port;
+    const char *path;
+
+    /** Duration of the last successful connect + handshake (in ms). */
+    uint16_t latency;
+    /** Consecutive failed attempts/dropped connections. */
+    uint8_t failures;
+  };
+
+  /** What send() does when the send queue is full. */
+  enum class OverflowPolicy : uint8_t {
+    /** Discards the oldest queued messages to make room. */
+    DROP_OLDEST,
+    /** Discards the message being sent. */
+    DROP_NEWEST,
+    /**
+     * Runs the pending handshake to completion, then sends the message
+     * directly (or drops it if the connection could not be established).
+     */
+    BLOCK
+  };
 
 public:
-  WebSocketClient() = default;
-  ~WebSocketClient() = default;
+  ~WebSocketClientBase() = default;
 
   /**
-   * @brief Attempts to connect to a server.
+   * @brief Attempts to connect to a server (blocks until the handshake is
+   * done or has failed).
+   * @param supportedProtocols Comma separated list (sent as is, names up to
+   * 31 characters), by default the table given to setProtocols().
+   * @note Strings are not copied, they are used again by reconnection.
    * @remark Do not use "ws://"
    */
   bool open(const char *host, uint16_t port = 3000, const char *path = "/",
     const char *supportedProtocols = nullptr);
-  void terminate();
+  /**
+   * @brief Starts connecting to a server and returns immediately, the
+   * connection is then established by subsequent listen() calls.
+   * @code{.cpp}
+   * client.openAsync("192.168.46.4", 3000);
+   * // getReadyState() == CONNECTING, onOpen or onError will be called from
+   * // listen() when the handshake is finished
+   * @endcode
+   * @note Strings are not copied, they are used again by reconnection.
+   * @remark TCP connect itself is as blocking as the network controller's
+   * connect() is.
+   */
+  void openAsync(const char *host, uint16_t port = 3000, const char *path = "/",
+    const char *supportedProtocols = nullptr);
+  /**
+   * @brief Attempts to connect to the given servers (in order of preference),
+   * blocks until connected or each server has failed.
+   * @note The array is not copied, it has to outlive the client.
+   */
+  bool open(Endpoint endpoints[], uint8_t count,
+    const char *supportedProtocols = nullptr);
+  /**
+   * @brief Non-blocking version of open(Endpoint[], ...). When an attempt
+   * fails or the connection is lost, the next server is tried right away if
+   * it has not failed yet, otherwise the reconnect policy applies.
+   * @note The array is not copied, it has to outlive the client.
+   */
+  void openAsync(Endpoint endpoints[], uint8_t count,
+    const char *supportedProtocols = nullptr);
+  /**
+   * @brief Sends a close event, a handshake in progress is abandoned.
+   * @remark Stops automatic reconnection (until the next open()).
+   * @see WebSocket::close
+   */
+  void close(const CloseCode, bool instant, const char *reason = nullptr,
+    uint16_t length = 0) override;
+  /**
+   * @brief Immediately closes the connection.
+   * @remark Stops automatic reconnection (until the next open()).
+   */
+  void terminate() override;
+
+  /**
+   * @brief Enables automatic reconnection, attempts are made (non-blocking)
+   * from listen() whenever the connection is lost or could not be
+   * established.
+   * @code{.cpp}
+   * WebSocketClient::ReconnectPolicy policy;
+   * policy.initialDelay = 500;
+   * policy.maxDelay = 30000;
+   * client.setReconnectPolicy(policy);
+   * client.openAsync("192.168.46.4", 3000);
+   * @endcode
+   */
+  void setReconnectPolicy(const ReconnectPolicy &);
+  /** @brief Disables automatic reconnection. */
+  void disableReconnect();
+  /** @return Total number of reconnection attempts. */
+  uint16_t getReconnectCount() const;
+
+  /**
+   * @brief Registers subprotocols supported by the client. The one selected
+   * by the server has to be in the table (otherwise the handshake fails),
+   * getProtocol() then returns the table entry.
+   * @code{.cpp}
+   * const char *const protocols[]{"chat", "superchat"};
+   * client.setProtocols(protocols, 2);
+   * client.open("192.168.46.4", 3000);
+   * @endcode
+   * @note The table is not copied. Without it the selected subprotocol is
+   * ignored.
+   */
+  void setProtocols(const char *const protocols[], uint8_t count);
 
-  /** @note Call this in the main loop. */
+  /**
+   * @brief Keeps a second, already handshaked connection to the next best
+   * server, traffic switches to it as soon as the current connection dies
+   * (onClose then onOpen are called).
+   * @code{.cpp}
+   * WebSocketClient client, standby;
+   * client.setStandby(&standby);
+   * client.openAsync(endpoints, 2);
+   * @endcode
+   * @param standby Client used only to hold the spare connection, driven by
+   * listen() of this one (nullptr disables). Its message callbacks are not
+   * called before the switch.
+   */
+  void setStandby(WebSocketClientBase *standby);
+  /** @return Server of the current (or pending) connection. */
+  const Endpoint &getEndpoint() const;
+
+  /**
+   * @brief Enables a send queue, messages sent while the client is connecting
+   * (or waiting to reconnect) are stored in the given buffer and go out in a
+   * single write right after the handshake (before onOpen callback).
+   * @code{.cpp}
+   * char queue[256];
+   * client.setSendQueue(queue, sizeof(queue));
+   * @endcode
+   * @param buffer Storage for queued messages (each takes 8 bytes + length),
+   * has to outlive the client. nullptr disables the queue.
+   */
+  void setSendQueue(char *buffer, uint16_t size,
+    OverflowPolicy = OverflowPolicy::DROP_OLDEST);
+
+  /**
+   * @brief Sends a message frame, or queues it if the connection is not open
+   * yet (see setSendQueue).
+   * @param message Doesn't have to be NULL-terminated.
+   * @return false if the message was dropped.
+   */
+  bool send(const DataType, const char *message, uint16_t length) override;
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  /**
+   * @brief Messages posted to the queue (from any task) are sent by listen()
+   * while the connection is open, nullptr disables.
+   * @note The queue has to outlive the client.
+   */
+  void setPostQueue(PostQueue *queue);
+#endif
+
+  /**
+   * @note Call this in the main loop, it reads frames while data is
+   * available, up to kMaxFramesPerListen (see setMaxFramesPerListen()).
+   */
   void listen();
+  /** @brief Limits frames read by a single listen() call, 0 = no limit. */
+  void setMaxFramesPerListen(uint8_t count);
+  /**
+   * @brief Limits duration of a single listen() call (in microseconds),
+   * 0 = no limit. Checked between frames, so a frame is never cut.
+   */
+  void setListenTimeBudget(uint32_t duration);
+
+#ifdef _LATENCY_HISTOGRAMS
+  /**
+   * @return Durations of listen() calls, frame parsing, onMessage callbacks
+   * and frame writes (call reset() to start over).
+   */
+  LatencyHistograms &getHistograms();
+#endif
 
   /**
    * @brief Sets callback that will be called on a successfull connection.
@@ -51,20 +250,149 @@ public:
    * @endcode
    */
   void onError(const onErrorCallback &);
+  /**
+   * @brief Sets error handler that gets the given context (e.g. the client
+   * itself, to reach its user data).
+   * @code{.cpp}
+   * client.onError([](const WebSocketError code, void *context) {
+   *   static_cast<App *>(context)->handleError(code);
+   * }, &app);
+   * @endcode
+   */
+  void onError(const onErrorContextCallback &, void *context);
+
+protected:
+  /** @param buffer Frame payload storage, owned by the derived class. */
+  WebSocketClientBase(char *buffer, uint16_t bufferSize);
 
 private:
+  /** Opening handshake steps, advanced by listen(). */
+  enum class HandshakeStep : uint8_t { NONE, CONNECT, READ_RESPONSE };
+
   /** @cond */
-  void _sendRequest(const char *host, uint16_t port, const char *path,
-    const char *secKey, const char *supportedProtocols);
-  bool _waitForResponse(uint16_t maxAttempts, uint8_t time = 1);
-  bool _readResponse(const char *secKey);
+  void _send(
+    uint8_t opcode, bool fin, const char *data, uint16_t length) override;
+  bool _readData(const header_t &, char *payload) override;
+
+  /// listen() without time measurement
+  void _poll();
+  void _terminate();
+
+  void _beginHandshake();
+  void _continueHandshake();
+  bool _waitForOpen();
+
+  void _recordFailure();
+
+  void _continueReconnect();
+  uint32_t _backoffDelay(uint8_t attempts) const;
+
+  uint8_t _pickEndpoint(uint8_t excluded) const;
+  void _connectTo(uint8_t endpoint);
+  void _maintainStandby();
+  bool _promoteStandby();
+
+  bool _isConnectionPending() const;
+  bool _enqueue(uint8_t opcode, const char *message, uint16_t length);
+  void _dropOldestMessage();
+  void _flushSendQueue();
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  void _drainPostQueue();
+#endif
+
+  void _sendRequest();
+  bool _readResponse();
+  bool _handleResponseLine(char *line);
   bool _validateHandshake(uint8_t flags);
   /** @endcond */
 private:
+  /// Used by open(host, port, ...)
+  Endpoint m_defaultEndpoint{};
+  Endpoint *m_endpoints{nullptr};
+  uint8_t m_endpointCount{0};
+  uint8_t m_currentEndpoint{0};
+  const char *m_supportedProtocols{nullptr};
+  /// Entry of m_supportedProtocols chosen by the server (that list isn't NULL
+  /// separated, m_protocol points here).
+  char m_protocolName[32]{};
+  const char *const *m_protocols{nullptr};
+  uint8_t m_protocolCount{0};
+
+  WebSocketClientBase *m_standby{nullptr};
+
+  HandshakeStep m_handshakeStep{HandshakeStep::NONE};
+  char m_secKey[25]{};
+  uint8_t m_handshakeFlags{0};
+  uint8_t m_responseLine{0};
+  /// Time when the request was sent, the connection opened or the reconnection
+  /// got scheduled (depending on the current ready state).
+  uint32_t m_stateTime{0};
+
+  ReconnectPolicy m_reconnectPolicy;
+  bool m_reconnectEnabled{false};
+  /// Cleared by an explicit close(), reconnection is not wanted then.
+  bool m_autoReconnect{false};
+  bool m_reconnectScheduled{false};
+  uint32_t m_reconnectDelay{0};
+  /// Consecutive attempts (reset once the connection is stable).
+  uint8_t m_reconnectAttempts{0};
+  uint16_t m_reconnectCount{0};
+
+  uint8_t m_maxFramesPerListen{kMaxFramesPerListen};
+  uint32_t m_listenTimeBudget{0};
+
+  /// Records: [opcode, length (2 bytes), reserved][payload], each record has
+  /// kMaxFrameHeaderSize bytes in front of the payload so the frame can be
+  /// built in place.
+  char *m_sendQueue{nullptr};
+  uint16_t m_sendQueueSize{0};
+  uint16_t m_sendQueueUsed{0};
+  OverflowPolicy m_overflowPolicy{OverflowPolicy::DROP_OLDEST};
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  PostQueue *m_postQueue{nullptr};
+#endif
+
+#ifdef _LATENCY_HISTOGRAMS
+  LatencyHistograms m_latency;
+#endif
+
   onOpenCallback _onOpen{nullptr};
   onErrorCallback _onError{nullptr};
+  onErrorContextCallback _onErrorWithContext{nullptr};
+  void *m_errorContext{nullptr};
 };
 
+/**
+ * @class BasicWebSocketClient
+ * @brief Client with a data buffer of BufferSize bytes (maximum size of frame
+ * payload).
+ * @note The handshake response is read line by line into the same buffer,
+ * so it can't be smaller than 64 bytes ('Sec-WebSocket-Accept' line).
+ * @code{.cpp}
+ * BasicWebSocketClient<1024> client; // large frames from upstream server
+ * @endcode
+ */
+template <uint16_t BufferSize>
+class BasicWebSocketClient final : public WebSocketClientBase {
+  static_assert(BufferSize >= 64,
+    "Buffer has to hold a handshake response line (64 bytes)");
+
+public:
+  BasicWebSocketClient() : WebSocketClientBase{m_buffer, BufferSize} {}
+
+private:
+  char m_buffer[BufferSize]{};
+};
+
+/** Client with the default data buffer size (kBufferMaxSize). */
+using WebSocketClient = BasicWebSocketClient<kBufferMaxSize>;
+
+/** @cond */
+/** @param[out] output Array of 4 elements (without NULL). */
+void generateMask(char output[]);
+void applyMask(char *data, uint16_t length, const char maskingKey[]);
+/** @endcond */
+
 /**
  * @example ./simple-client/simple-client.ino
  * Example usage of WebSocketClient class
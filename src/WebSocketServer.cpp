@@ -4,88 +4,241 @@
 
 namespace net {
 
-WebSocketServer::WebSocketServer(uint16_t port) : m_server{port} {}
-WebSocketServer::~WebSocketServer() { shutdown(); }
+//
+// HandshakeRequest struct implementation:
+//
+
+void HandshakeRequest::reset(const NetClient &newClient) {
+  client = newClient;
+  active = true;
+  memset(buffer, '\0', sizeof(buffer));
+  counter = 0;
+  currentLine = 0;
+  secKey[0] = '\0';
+  flags = 0;
+  protocols[0] = '\0';
+  path[0] = '\0';
+  memset(ifNoneMatch, '\0', sizeof(ifNoneMatch));
+  startTime = clockMillis();
+}
+
+//
+// WebSocketServerBase class implementation:
+//
+
+WebSocketServerBase::WebSocketServerBase(
+  uint16_t port, WebSocket *sockets[], uint8_t maxConnections)
+  : m_server{port}, m_sockets{sockets}, m_maxConnections{maxConnections} {}
 
-void WebSocketServer::begin(const verifyClientCallback &verifyClient,
+void WebSocketServerBase::begin(const verifyClientCallback &verifyClient,
   const protocolHandlerCallback &protocolHandler) {
   _verifyClient = verifyClient;
   _protocolHandler = protocolHandler;
+  _verifyClientWithContext = nullptr;
+  _protocolHandlerWithContext = nullptr;
   m_server.begin();
 }
-void WebSocketServer::shutdown() {
-  for (auto ws : m_sockets) {
+void WebSocketServerBase::begin(
+  const verifyClientContextCallback &verifyClient,
+  const protocolHandlerContextCallback &protocolHandler, void *context) {
+  _verifyClient = nullptr;
+  _protocolHandler = nullptr;
+  _verifyClientWithContext = verifyClient;
+  _protocolHandlerWithContext = protocolHandler;
+  m_callbackContext = context;
+  m_server.begin();
+}
+void WebSocketServerBase::setProtocols(
+  const char *const protocols[], uint8_t count) {
+  m_protocols = protocols;
+  m_protocolCount = count;
+}
+void WebSocketServerBase::setAssets(
+  const StaticAsset assets[], uint8_t count) {
+  m_assets = assets;
+  m_assetCount = count;
+}
+void WebSocketServerBase::setRoutes(const Route routes[], uint8_t count) {
+  m_routes = routes;
+  m_routeCount = count;
+}
+void WebSocketServerBase::shutdown() {
+  for (uint8_t i = 0; i < m_maxConnections; ++i) {
+    auto &ws = m_sockets[i];
     if (ws) {
       ws->close(WebSocket::CloseCode::GOING_AWAY, true);
-      SAFE_DELETE(ws);
+      _removeWebSocket(ws);
     }
   }
+  for (auto &request : m_requests) {
+    if (!request.active) continue;
+    request.client.stop();
+    request.client = NetClient{};
+    request.active = false;
+  }
 
   // Here I shoud call somethig like m_server.close() but unfortunately
   // EthernetServer does not implement anything like that
   // #TODO server state enum?
 }
 
-void WebSocketServer::broadcast(
+void WebSocketServerBase::broadcast(
   const WebSocket::DataType dataType, const char *message, uint16_t length) {
-  for (auto ws : m_sockets)
+  for (uint8_t i = 0; i < m_maxConnections; ++i) {
+    auto ws = m_sockets[i];
     if (ws && ws->getReadyState() == WebSocket::ReadyState::OPEN)
       ws->send(dataType, message, length);
+  }
 }
 
-void WebSocketServer::listen() {
+uint8_t WebSocketServerBase::listen() {
+  const uint32_t startTime{clockMicros()};
   _cleanDeadConnections();
 
-  auto client = m_server.available();
-  if (client) {
-    auto ws = _getWebSocket(client);
-    if (!ws) {
-      // A new client
-      bool clientRequestFailed = false;
-      for (auto &it : m_sockets) {
-        if (!it) {
-          char selectedProtocol[32]{};
-          if (_handleRequest(client, selectedProtocol)) {
-            ws = it = new WebSocket{
-              client, *selectedProtocol ? selectedProtocol : nullptr};
-            if (_onConnection) _onConnection(*ws);
-          } else {
-            clientRequestFailed = true;
-          }
-          break;
-        }
-      }
-      if (!clientRequestFailed && !ws) {
-        // Server is full
-        _rejectRequest(client, WebSocketError::SERVICE_UNAVAILABLE);
-      }
-    }
+  // Without a free entry new clients are left in the backlog (not accepted)
+  auto request = _findFreeRequest();
+  if (request) {
+    auto client = m_server.available();
+    if (client && !_getWebSocket(client) && !_isPendingRequest(client))
+      request->reset(client);
   }
-  for (auto it : m_sockets) {
-    if (it && it->m_client.connected() && it->m_client.available()) {
-      it->_readFrame();
-    }
+
+  uint8_t pending{_handleRequests(startTime)};
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  if (m_postQueue && !_drainPostQueue(startTime)) ++pending;
+#endif
+
+  // Round-robin, so the lower slots are not always served first
+  for (uint8_t i = 0; i < m_maxConnections; ++i) {
+    auto it = m_sockets[(m_nextSlot + i) % m_maxConnections];
+    if (!it) continue;
+    if (!_drainWebSocket(*it, startTime)) ++pending;
+    it->_flushIfDue(); // Replies sent from callbacks go out together
   }
+  m_nextSlot = (m_nextSlot + 1) % m_maxConnections;
+
+  __measureLatency(m_latency.loop.record(clockMicros() - startTime));
+  return pending;
+}
+void WebSocketServerBase::setListenPolicy(const ListenPolicy &policy) {
+  m_listenPolicy = policy;
 }
 
-uint8_t WebSocketServer::countClients() const {
+uint8_t WebSocketServerBase::countClients() const {
   uint8_t count{0};
-  for (auto ws : m_sockets)
-    if (ws && ws->isAlive()) ++count;
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (m_sockets[i] && m_sockets[i]->isAlive()) ++count;
 
   return count;
 }
 
-void WebSocketServer::onConnection(const onConnectionCallback &callback) {
+#ifdef _TRAFFIC_STATS
+WebSocketServerStats WebSocketServerBase::getStats() const {
+  auto stats = m_stats;
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (m_sockets[i]) stats.traffic += m_sockets[i]->m_stats;
+
+  return stats;
+}
+void WebSocketServerBase::resetStats() {
+  m_stats = WebSocketServerStats{};
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (m_sockets[i]) m_sockets[i]->resetStats();
+}
+#endif
+
+#ifdef _LATENCY_HISTOGRAMS
+LatencyHistograms &WebSocketServerBase::getHistograms() { return m_latency; }
+#endif
+
+void WebSocketServerBase::setBufferPool(MessageBufferPool *pool) {
+  m_bufferPool = pool;
+}
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+void WebSocketServerBase::setPostQueue(PostQueue *queue) {
+  m_postQueue = queue;
+}
+#endif
+
+void WebSocketServerBase::onConnection(
+  const onConnectionCallback &callback, void *context) {
   _onConnection = callback;
+  m_connectionContext = context;
+}
+
+WebSocket *WebSocketServerBase::_getWebSocket(NetClient &client) const {
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (m_sockets[i] && m_sockets[i]->m_client == client) return m_sockets[i];
+
+  return nullptr;
+}
+bool WebSocketServerBase::_isPendingRequest(NetClient &client) const {
+  for (const auto &request : m_requests)
+    if (request.active && request.client == client) return true;
+
+  return false;
 }
 
-WebSocket *WebSocketServer::_getWebSocket(NetClient &client) const {
-  for (auto ws : m_sockets)
-    if (ws && ws->m_client == client) return ws;
+HandshakeRequest *WebSocketServerBase::_findFreeRequest() {
+  // Requests are read even when the server is full, those for assets need no
+  // slot (upgrades are rejected once complete)
+  for (auto &request : m_requests)
+    if (!request.active) return &request;
 
   return nullptr;
 }
+bool WebSocketServerBase::_hasFreeSlot() const {
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (!m_sockets[i]) return true;
+
+  return false;
+}
+uint8_t WebSocketServerBase::_handleRequests(uint32_t startTime) {
+  const auto &policy = m_listenPolicy;
+  uint8_t pending{0};
+  for (auto &request : m_requests) {
+    if (!request.active) continue;
+    if (policy.timeBudget && clockMicros() - startTime >= policy.timeBudget) {
+      ++pending;
+      continue;
+    }
+
+    const char *selectedProtocol{nullptr};
+    const Route *route{nullptr};
+    const auto state = _handleRequest(request, selectedProtocol, route);
+    if (state == RequestState::PENDING) continue;
+    if (state == RequestState::ACCEPTED)
+      _addWebSocket(request.client, selectedProtocol, route);
+    request.client = NetClient{}; // Copy kept by the connection (if any)
+    request.active = false;
+  }
+  return pending;
+}
+void WebSocketServerBase::_addWebSocket(
+  const NetClient &client, const char *selectedProtocol, const Route *route) {
+  for (uint8_t i = 0; i < m_maxConnections; ++i) {
+    auto &ws = m_sockets[i];
+    if (ws) continue;
+
+    ws = _createWebSocket(client, selectedProtocol);
+    if (++m_lastId == 0) ++m_lastId; // 0 stands for no connection
+    ws->m_id = m_lastId;
+    ws->m_route = route;
+    ws->m_bufferPool = m_bufferPool;
+    __measureLatency(ws->m_histograms = &m_latency);
+    ws->m_userData = m_connectionContext;
+    __updateStats(++m_stats.acceptedHandshakes);
+
+    auto onConnection = _onConnection;
+    if (route) {
+      Route entry;
+      memcpy_P(&entry, route, sizeof(Route));
+      if (entry.onConnection) onConnection = entry.onConnection;
+    }
+    if (onConnection) onConnection(*ws);
+    return;
+  }
+}
 
 //
 // Read client request:
@@ -98,39 +251,34 @@ WebSocket *WebSocketServer::_getWebSocket(NetClient &client) const {
 // [6] Sec-WebSocket-Version: 13
 // [7]
 //
-bool WebSocketServer::_handleRequest(
-  NetClient &client, char selectedProtocol[]) {
-#if NETWORK_CONTROLLER == NETWORK_CONTROLLER_WIFI
-  while (!client.available()) {
-    delay(10);
-    __debugOutput(F("."));
-  }
-#endif
-
-  // Large enought to hold the longest header field
-  //  Chrome: 'User-Agent' = ~126 characters
-  //  Edge: 'User-Agent' = ~141 characters
-  //  Firefox: 'User-Agent' = ~90 characters
-  //  Opera: 'User-Agent' = ~145 characters
-  char buffer[160]{};
-
-  char secKey[32]{}; // Holds client Sec-WebSocket-Key
-  uint8_t flags{0};
-  char protocols[32]{};
+WebSocketServerBase::RequestState WebSocketServerBase::_handleRequest(
+  HandshakeRequest &request, const char *&selectedProtocol,
+  const Route *&route) {
+  auto &client = request.client;
+  auto &buffer = request.buffer;
+  auto &counter = request.counter;
+  auto &currentLine = request.currentLine;
+  auto &secKey = request.secKey;
+  auto &flags = request.flags;
+  auto &protocols = request.protocols;
+  auto &path = request.path;
+  auto &ifNoneMatch = request.ifNoneMatch;
 
   int32_t bite{-1};
-  byte currentLine{0};
-  byte counter{0};
-
-  while ((bite = client.read()) != -1) {
-    buffer[counter++] = bite;
+  while (true) {
+    if ((bite = client.read()) == -1) {
+      // The rest of the request is read by next listen() calls
+      if (client.connected() &&
+          clockMillis() - request.startTime < kTimeoutInterval)
+        return RequestState::PENDING;
+      break;
+    }
+    // Excess of an overlong line is dropped
+    if (counter < sizeof(buffer) - 1 || bite == '\n') buffer[counter++] = bite;
 
     if (bite == '\n') {
       const auto lineBreakPos = static_cast<uint8_t>(strcspn(buffer, "\r\n"));
       buffer[lineBreakPos] = '\0';
-#ifdef _DUMP_HANDSHAKE
-      printf(F("[Line #%u] %s\n"), currentLine, buffer);
-#endif
 
       char *rest{buffer};
 
@@ -139,9 +287,9 @@ bool WebSocketServer::_handleRequest(
       //
 
       if (currentLine == 0) {
-        if (!_isValidGET(rest)) {
+        if (!_isValidGET(rest, path)) {
           _rejectRequest(client, WebSocketError::BAD_REQUEST);
-          return false;
+          return RequestState::CLOSED;
         }
       } else {
         if (lineBreakPos > 0) {
@@ -164,7 +312,7 @@ bool WebSocketServer::_handleRequest(
             value = strtok_r(rest, " ", &rest);
             if (!value || !_isValidUpgrade(value)) {
               _rejectRequest(client, WebSocketError::BAD_REQUEST);
-              return false;
+              return RequestState::CLOSED;
             }
             flags |= kValidUpgradeHeader;
           }
@@ -196,7 +344,7 @@ bool WebSocketServer::_handleRequest(
             value = strtok_r(rest, " ", &rest);
             if (!value || !_isValidVersion(atoi(value))) {
               _rejectRequest(client, WebSocketError::BAD_REQUEST);
-              return false;
+              return RequestState::CLOSED;
             }
             flags |= kValidVersion;
           }
@@ -219,11 +367,24 @@ bool WebSocketServer::_handleRequest(
           //
 
           else {
-            if (_verifyClient) {
+            if (m_assets && rest) {
+              if (strcasecmp_P(header, (PGM_P)F("If-None-Match")) == 0) {
+                strncpy(ifNoneMatch, rest + strspn(rest, " "),
+                  sizeof(ifNoneMatch) - 1);
+              } else if (strcasecmp_P(header, (PGM_P)F("Accept-Encoding")) ==
+                           0 &&
+                         strstr_P(rest, (PGM_P)F("gzip"))) {
+                flags |= kAcceptsGzip;
+              }
+            }
+            if (_verifyClient || _verifyClientWithContext) {
               value = strtok_r(rest, " ", &rest);
-              if (!_verifyClient(fetchRemoteIp(client), header, value)) {
+              const auto ip = fetchRemoteIp(client);
+              if (_verifyClient ? !_verifyClient(ip, header, value)
+                                : !_verifyClientWithContext(
+                                    ip, header, value, m_callbackContext)) {
                 _rejectRequest(client, WebSocketError::CONNECTION_REFUSED);
-                return false;
+                return RequestState::CLOSED;
               }
             }
           }
@@ -234,20 +395,51 @@ bool WebSocketServer::_handleRequest(
         //
 
         else {
+          // Plain GET, the upgrade path below stays as it is
+          StaticAsset asset;
+          if (!(flags & kValidUpgradeHeader) && m_assets &&
+              _findAsset(path, asset)) {
+            _serveAsset(client, asset, ifNoneMatch, flags & kAcceptsGzip,
+              buffer, sizeof(buffer));
+            return RequestState::CLOSED;
+          }
+
           const auto errorCode = _validateHandshake(flags, secKey);
           if (errorCode != WebSocketError::NO_ERROR) {
             _rejectRequest(client, errorCode);
-            return false;
+            return RequestState::CLOSED;
           }
 
-          selectedProtocol[0] = '\0';
-          if (*protocols) {
-            strcpy(selectedProtocol, _protocolHandler
-                                       ? _protocolHandler(protocols)
-                                       : strtok_r(protocols, ",", &rest));
+          auto protocolTable = m_protocols;
+          auto protocolCount = m_protocolCount;
+          if (m_routes) {
+            Route entry;
+            route = _findRoute(path, entry);
+            if (!route) {
+              _rejectRequest(client, WebSocketError::NOT_FOUND);
+              return RequestState::CLOSED;
+            }
+            if (entry.maxConnections &&
+                _countConnections(route) >= entry.maxConnections) {
+              _rejectRequest(client, WebSocketError::SERVICE_UNAVAILABLE);
+              return RequestState::CLOSED;
+            }
+            if (entry.protocols) {
+              protocolTable = entry.protocols;
+              protocolCount = entry.protocolCount;
+            }
+          }
+          if (!_hasFreeSlot()) {
+            // Server is full
+            _rejectRequest(client, WebSocketError::SERVICE_UNAVAILABLE);
+            return RequestState::CLOSED;
           }
+
+          selectedProtocol = *protocols ? _selectProtocol(protocols,
+                                            protocolTable, protocolCount)
+                                        : nullptr;
           _acceptRequest(client, secKey, selectedProtocol);
-          return true;
+          return RequestState::ACCEPTED;
         }
       }
 
@@ -257,10 +449,31 @@ bool WebSocketServer::_handleRequest(
     }
   }
 
+  // Gone or too slow
   _rejectRequest(client, WebSocketError::BAD_REQUEST);
-  return false;
+  return RequestState::CLOSED;
 }
-bool WebSocketServer::_isValidGET(char *line) {
+const char *WebSocketServerBase::_selectProtocol(char *requestedProtocols,
+  const char *const protocols[], uint8_t count) const {
+  if (_protocolHandler) {
+    return findProtocol(
+      protocols, count, _protocolHandler(requestedProtocols));
+  }
+  if (_protocolHandlerWithContext) {
+    return findProtocol(protocols, count,
+      _protocolHandlerWithContext(requestedProtocols, m_callbackContext));
+  }
+
+  char *rest{requestedProtocols};
+  char *item{nullptr};
+  while ((item = strtok_r(rest, ",", &rest))) {
+    const auto protocol = findProtocol(protocols, count, item);
+    if (protocol) return protocol;
+  }
+
+  return nullptr;
+}
+bool WebSocketServerBase::_isValidGET(char *line, char *path) {
   char *rest{line};
   for (byte i = 0; rest != nullptr; ++i) {
     const auto pch = strtok_r(rest, " ", &rest);
@@ -272,7 +485,10 @@ bool WebSocketServer::_isValidGET(char *line) {
       break;
     }
     case 1: {
-      break; // path doesn't matter ...
+      if (!pch) return false;
+      strncpy(path, pch, kMaxPathSize - 1);
+      path[strcspn(path, "?")] = '\0'; // Query doesn't matter ...
+      break;
     }
     case 2: {
       if (strcmp_P(pch, (PGM_P)F("HTTP/1.1")) != 0) {
@@ -287,10 +503,10 @@ bool WebSocketServer::_isValidGET(char *line) {
 
   return true;
 }
-bool WebSocketServer::_isValidUpgrade(const char *value) {
+bool WebSocketServerBase::_isValidUpgrade(const char *value) {
   return strcasecmp_P(value, (PGM_P)F("websocket")) == 0;
 }
-bool WebSocketServer::_isValidConnection(char *value) {
+bool WebSocketServerBase::_isValidConnection(char *value) {
   char *rest{value};
   char *item{nullptr};
 
@@ -304,7 +520,7 @@ bool WebSocketServer::_isValidConnection(char *value) {
 
   return false;
 }
-bool WebSocketServer::_isValidVersion(uint8_t version) {
+bool WebSocketServerBase::_isValidVersion(uint8_t version) {
   switch (version) {
   case 8:
   case 13:
@@ -312,7 +528,7 @@ bool WebSocketServer::_isValidVersion(uint8_t version) {
   }
   return false;
 }
-WebSocketError WebSocketServer::_validateHandshake(
+WebSocketError WebSocketServerBase::_validateHandshake(
   uint8_t flags, const char *secKey) {
   if ((flags & (kValidConnectionHeader | kValidUpgradeHeader)) !=
       (kValidConnectionHeader | kValidUpgradeHeader)) {
@@ -324,23 +540,33 @@ WebSocketError WebSocketServer::_validateHandshake(
 
   return WebSocketError::NO_ERROR;
 }
-void WebSocketServer::_rejectRequest(
+void WebSocketServerBase::_rejectRequest(
   NetClient &client, const WebSocketError code) {
+  __trace(TraceEvent::HANDSHAKE, this, 0, 0, static_cast<uint16_t>(code));
   switch (code) {
   case WebSocketError::CONNECTION_REFUSED: {
     client.println(F("HTTP/1.1 111 Connection refused"));
+    __updateStats(++m_stats.connectionRefused);
     break;
   }
   case WebSocketError::BAD_REQUEST: {
     client.println(F("HTTP/1.1 400 Bad Request"));
+    __updateStats(++m_stats.badRequest);
+    break;
+  }
+  case WebSocketError::NOT_FOUND: {
+    client.println(F("HTTP/1.1 404 Not Found"));
+    __updateStats(++m_stats.notFound);
     break;
   }
   case WebSocketError::UPGRADE_REQUIRED: {
     client.println(F("HTTP/1.1 426 Upgrade Required"));
+    __updateStats(++m_stats.upgradeRequired);
     break;
   }
   case WebSocketError::SERVICE_UNAVAILABLE: {
     client.println(F("HTTP/1.1 503 Service Unavailable"));
+    __updateStats(++m_stats.serviceUnavailable);
     break;
   }
   default: {
@@ -361,8 +587,9 @@ void WebSocketServer::_rejectRequest(
 // [4] Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=
 // [5]
 //
-void WebSocketServer::_acceptRequest(
+void WebSocketServerBase::_acceptRequest(
   NetClient &client, const char *secKey, const char *protocol) {
+  __trace(TraceEvent::HANDSHAKE, this, 0, 0, 101);
   client.println(F("HTTP/1.1 101 Switching Protocols"));
   // client.println(F("Server: Arduino"));
   client.println(F("X-Powered-By: mWebSockets"));
@@ -375,7 +602,7 @@ void WebSocketServer::_acceptRequest(
   encodeSecKey(secKey, buffer + 22);
   client.println(buffer);
 
-  if (protocol[0] != '\0') {
+  if (protocol) {
     // NOTE: Up to 26 characters for protocol value
     snprintf_P(
       buffer, sizeof(buffer), (PGM_P)F("Sec-WebSocket-Protocol: %s"), protocol);
@@ -385,13 +612,166 @@ void WebSocketServer::_acceptRequest(
   client.println();
 }
 
-void WebSocketServer::_cleanDeadConnections() {
-  for (auto &it : m_sockets) {
-    if (it && !it->isAlive()) {
-      delete it;
-      it = nullptr;
+bool WebSocketServerBase::_findAsset(
+  const char *path, StaticAsset &asset) const {
+  for (uint8_t i = 0; i < m_assetCount; ++i) {
+    memcpy_P(&asset, &m_assets[i], sizeof(StaticAsset));
+    if (strcmp_P(path, asset.path) == 0) return true;
+  }
+  return false;
+}
+const Route *WebSocketServerBase::_findRoute(
+  const char *path, Route &entry) const {
+  for (uint8_t i = 0; i < m_routeCount; ++i) {
+    memcpy_P(&entry, &m_routes[i], sizeof(Route));
+    const auto match = entry.prefix
+                         ? strncmp_P(path, entry.path, strlen_P(entry.path))
+                         : strcmp_P(path, entry.path);
+    if (match == 0) return &m_routes[i];
+  }
+  return nullptr;
+}
+uint8_t WebSocketServerBase::_countConnections(const Route *route) const {
+  uint8_t count{0};
+  for (uint8_t i = 0; i < m_maxConnections; ++i)
+    if (m_sockets[i] && m_sockets[i]->m_route == route) ++count;
+
+  return count;
+}
+
+//
+// Serve static asset:
+//
+// [1] HTTP/1.1 200 OK
+// [2] Content-Type: text/html
+// [3] Content-Length: 1234
+// [4] Content-Encoding: gzip
+// [5] ETag: "v1"
+// [6] Cache-Control: no-cache
+// [7] Connection: close
+// [8]
+// [9] <body>
+//
+void WebSocketServerBase::_serveAsset(NetClient &client,
+  const StaticAsset &asset, const char *ifNoneMatch, bool acceptsGzip,
+  char *buffer, uint8_t size) {
+  // Quoted, as it comes back in If-None-Match
+  char etag[34]{};
+  if (asset.etag) {
+    etag[0] = '"';
+    strncpy_P(etag + 1, asset.etag, sizeof(etag) - 3);
+    strcat(etag, "\"");
+  }
+
+  if (*etag &&
+      (strcmp(ifNoneMatch, "*") == 0 || strstr(ifNoneMatch, etag) != nullptr)) {
+    __trace(TraceEvent::HANDSHAKE, this, 0, 0, 304);
+    __updateStats(++m_stats.servedAssets);
+    client.println(F("HTTP/1.1 304 Not Modified"));
+    client.print(F("ETag: "));
+    client.println(etag);
+    client.println(F("Connection: close"));
+    client.println();
+  } else if (asset.gzip && !acceptsGzip) {
+    // There is no uncompressed copy to fall back to
+    __trace(TraceEvent::HANDSHAKE, this, 0, 0, 406);
+    __updateStats(++m_stats.notAcceptable);
+    client.println(F("HTTP/1.1 406 Not Acceptable"));
+    client.println(F("Connection: close"));
+    client.println();
+  } else {
+    __trace(TraceEvent::HANDSHAKE, this, 0, 0, 200);
+    __updateStats(++m_stats.servedAssets);
+    client.println(F("HTTP/1.1 200 OK"));
+    client.println(F("X-Powered-By: mWebSockets"));
+    client.print(F("Content-Type: "));
+    client.println(reinterpret_cast<const __FlashStringHelper *>(
+      asset.contentType));
+    snprintf_P(buffer, size, (PGM_P)F("Content-Length: %lu"),
+      static_cast<unsigned long>(asset.length));
+    client.println(buffer);
+    if (asset.gzip) client.println(F("Content-Encoding: gzip"));
+    if (*etag) {
+      client.print(F("ETag: "));
+      client.println(etag);
     }
+    client.println(F("Cache-Control: no-cache"));
+    client.println(F("Connection: close"));
+    client.println();
+
+    // Body goes through the request buffer, a chunk at a time
+    for (uint32_t offset = 0; offset < asset.length; offset += size) {
+      const uint32_t left{asset.length - offset};
+      const auto length = static_cast<uint8_t>(left < size ? left : size);
+      memcpy_P(buffer, asset.data + offset, length);
+      client.write(reinterpret_cast<const uint8_t *>(buffer), length);
+    }
+  }
+
+  client.stop();
+}
+
+void WebSocketServerBase::_cleanDeadConnections() {
+  for (uint8_t i = 0; i < m_maxConnections; ++i) {
+    auto &it = m_sockets[i];
+    if (it && !it->isAlive()) _removeWebSocket(it);
   }
 }
+bool WebSocketServerBase::_drainWebSocket(WebSocket &ws, uint32_t startTime) {
+  const auto &policy = m_listenPolicy;
+  uint8_t frames{0};
+  uint32_t bytes{0};
+
+  while (ws.m_readyState != WebSocket::ReadyState::CLOSED &&
+         ws.m_client.connected()) {
+    if (ws.m_client.available() <= 0) return true;
+
+    if ((policy.framesPerClient && frames >= policy.framesPerClient) ||
+        (policy.bytesPerClient && bytes >= policy.bytesPerClient) ||
+        (policy.timeBudget && clockMicros() - startTime >= policy.timeBudget))
+      return false;
+
+    const auto bytesRead = ws.m_bytesRead;
+    ws._readFrame();
+    ++frames;
+    bytes += ws.m_bytesRead - bytesRead;
+
+    // Frame left unread (waiting for a pool buffer)
+    if (ws.m_framePending) return false;
+  }
+  return true;
+}
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+bool WebSocketServerBase::_drainPostQueue(uint32_t startTime) {
+  const auto &policy = m_listenPolicy;
+  for (uint16_t i = 0; i <= m_postQueue->m_mask; ++i) {
+    const auto message = m_postQueue->_front();
+    if (!message) break;
+    if (policy.timeBudget && clockMicros() - startTime >= policy.timeBudget)
+      return false;
+
+    const auto payload = PostQueue::_payload(message);
+    if (message->target) {
+      // The connection might be gone already (its slot even reused, ids are
+      // not)
+      for (uint8_t j = 0; j < m_maxConnections; ++j) {
+        if (m_sockets[j] && m_sockets[j]->m_id == message->target &&
+            m_sockets[j]->m_readyState == WebSocket::ReadyState::OPEN) {
+          m_sockets[j]->send(message->dataType, payload, message->length);
+          break;
+        }
+      }
+    } else {
+      broadcast(message->dataType, payload, message->length);
+    }
+    m_postQueue->_pop();
+  }
+  return true;
+}
+#endif
+void WebSocketServerBase::_removeWebSocket(WebSocket *&ws) {
+  __updateStats(m_stats.traffic += ws->m_stats);
+  SAFE_DELETE(ws);
+}
 
 } // namespace net
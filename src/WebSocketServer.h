@@ -2,15 +2,149 @@
 
 /** @file */
 
+#include "PostQueue.h"
 #include "WebSocket.h"
 #include "utility.h"
 
 namespace net {
 
+/** @cond */
+/** Longer request paths are cut. */
+constexpr uint8_t kMaxPathSize{64};
+
+/**
+ * @brief Handshake request read so far, kept between listen() calls (the
+ * request may arrive in several segments).
+ */
+struct HandshakeRequest {
+  /// Starts reading the request of a new client
+  void reset(const NetClient &);
+
+  NetClient client;
+  /// Free entry otherwise
+  bool active{false};
+
+  // Large enought to hold the longest header field
+  //  Chrome: 'User-Agent' = ~126 characters
+  //  Edge: 'User-Agent' = ~141 characters
+  //  Firefox: 'User-Agent' = ~90 characters
+  //  Opera: 'User-Agent' = ~145 characters
+  char buffer[160]{};
+  byte counter{0};
+  byte currentLine{0};
+
+  char secKey[32]{}; // Holds client Sec-WebSocket-Key
+  uint8_t flags{0};
+  char protocols[32]{};
+  char path[kMaxPathSize]{};
+  char ifNoneMatch[40]{}; // Only with assets (see setAssets())
+
+  uint32_t startTime{0};
+};
+/** @endcond */
+
+#ifdef _TRAFFIC_STATS
 /**
- * @class WebSocketServer
+ * @brief Traffic counters of a server.
+ * @note Available with _TRAFFIC_STATS defined (see config.h).
+ * @see WebSocketServerBase::getStats()
  */
-class WebSocketServer final {
+struct WebSocketServerStats {
+  /// All connections together, both current and closed ones
+  WebSocketStats traffic;
+
+  uint32_t acceptedHandshakes{0};
+
+  //
+  // Rejected handshakes by reason:
+  //
+
+  /// Malformed request
+  uint32_t badRequest{0};
+  /// Path of an upgrade not in the route table (see setRoutes())
+  uint32_t notFound{0};
+  /// Refused by verifyClient callback (see WebSocketServerBase::begin())
+  uint32_t connectionRefused{0};
+  /// Missing Upgrade/Connection header
+  uint32_t upgradeRequired{0};
+  /// No free slot (of the server or of the route)
+  uint32_t serviceUnavailable{0};
+
+  /// Plain GET requests answered with a static asset (200 or 304)
+  uint32_t servedAssets{0};
+  /// Plain GET requests for a gzip-only asset from a client without gzip
+  /// (answered with 406)
+  uint32_t notAcceptable{0};
+};
+#endif
+
+/**
+ * @brief File served to plain GET requests on the WebSocket port (e.g. the
+ * page of a dashboard), everything lives in flash.
+ * @code{.cpp}
+ * const char kIndexPath[] PROGMEM{"/"};
+ * const char kHtml[] PROGMEM{"text/html"};
+ * const char kIndexTag[] PROGMEM{"v1"};
+ * const uint8_t kIndexGz[] PROGMEM{0x1f, 0x8b, ...}; // gzip -9 index.html
+ *
+ * const StaticAsset assets[] PROGMEM{
+ *   {kIndexPath, kHtml, kIndexGz, sizeof(kIndexGz), kIndexTag, true},
+ * };
+ * @endcode
+ * @see WebSocketServerBase::setAssets()
+ */
+struct StaticAsset {
+  /** Request path, e.g. "/" (query string is ignored). */
+  PGM_P path;
+  /** Content-Type value, e.g. "text/html". */
+  PGM_P contentType;
+  const uint8_t *data;
+  uint32_t length;
+  /** Entity tag (without quotes) or nullptr, answers If-None-Match with 304. */
+  PGM_P etag;
+  /** Data is gzip-compressed (sent with Content-Encoding: gzip). */
+  bool gzip;
+};
+
+/**
+ * @brief Entry of the route table, sends upgrades of a path to their own
+ * connection handler.
+ * @code{.cpp}
+ * const char kChatPath[] PROGMEM{"/chat"};
+ * const char kSensorsPath[] PROGMEM{"/sensors/"};
+ * const char *const chatProtocols[]{"chat.v2", "chat"};
+ *
+ * const Route routes[] PROGMEM{
+ *   {kChatPath, false, onChat, 4, chatProtocols, 2},
+ *   {kSensorsPath, true, onSensor, 0, nullptr, 0},
+ * };
+ * @endcode
+ * @see WebSocketServerBase::setRoutes()
+ */
+struct Route {
+  /** Request path, e.g. "/chat" (query string is ignored). */
+  PGM_P path;
+  /** Matches every path starting with it, otherwise only the whole path. */
+  bool prefix;
+  /** Called for accepted clients, nullptr = the one of onConnection(). */
+  void (*onConnection)(WebSocket &ws);
+  /** Connections of the route at the same time, 0 = as many as slots. */
+  uint8_t maxConnections;
+  /**
+   * Subprotocols of the route (table in RAM, like for setProtocols()),
+   * nullptr = the table of the server.
+   */
+  const char *const *protocols;
+  uint8_t protocolCount;
+};
+
+/**
+ * @class WebSocketServerBase
+ * @brief Server logic, independent of the number of slots and the size of
+ * their data buffers.
+ * @see BasicWebSocketServer
+ */
+class WebSocketServerBase {
 public:
   /**
    * @param header c-string, NULL-terminated.
@@ -18,20 +152,40 @@ public:
    */
   using verifyClientCallback = bool (*)(
     const IPAddress &, const char *header, const char *value);
+  /** @param context Given to begin(). */
+  using verifyClientContextCallback = bool (*)(const IPAddress &,
+    const char *header, const char *value, void *context);
   /** @param ws Accepted client. */
   using onConnectionCallback = void (*)(WebSocket &ws);
   using protocolHandlerCallback = const char *(*)(const char *);
+  /** @param context Given to begin(). */
+  using protocolHandlerContextCallback = const char *(*)(
+    const char *, void *context);
 
-public:
   /**
-   * @brief Initializes server on given port.
-   * @note Don't forget to call begin()
+   * @brief How much work a single listen() call does. Connections are served
+   * in turns, each call starts from the next slot.
    */
-  WebSocketServer(uint16_t port = 3000);
-  WebSocketServer(const WebSocketServer &) = delete;
-  ~WebSocketServer();
+  struct ListenPolicy {
+    /** Frames read from one connection per call, 0 = no limit. */
+    uint8_t framesPerClient{kMaxFramesPerListen};
+    /**
+     * Bytes read from one connection per call, 0 = no limit (checked between
+     * frames, so a frame is never cut).
+     */
+    uint16_t bytesPerClient{0};
+    /**
+     * Duration of a single call (in microseconds), 0 = no limit. Remaining
+     * connections wait for the next call.
+     */
+    uint32_t timeBudget{0};
+  };
+
+public:
+  WebSocketServerBase(const WebSocketServerBase &) = delete;
+  virtual ~WebSocketServerBase() = default;
 
-  WebSocketServer &operator=(const WebSocketServer &) = delete;
+  WebSocketServerBase &operator=(const WebSocketServerBase &) = delete;
 
   /**
    * @brief Startup server.
@@ -47,22 +201,115 @@ public:
    * @endcode
    * @param callback Function called for every header during hadshake (except
    * for those required by protocol, like **Connection**, **Upgrade** etc.)
+   * @param protocolHandler Picks one of the requested subprotocols, the result
+   * has to be in the table given to setProtocols() (otherwise ignored).
+   * Without it the first requested subprotocol from the table is chosen.
    */
   void begin(const verifyClientCallback &verifyClient = nullptr,
     const protocolHandlerCallback &protocolHandler = nullptr);
+  /**
+   * @brief Startup server, callbacks get the given context (e.g. the
+   * application object).
+   * @code{.cpp}
+   * server.begin(
+   *   [](const IPAddress &ip, const char *header, const char *value,
+   *     void *context) {
+   *     return static_cast<App *>(context)->isAllowed(ip);
+   *   },
+   *   nullptr, &app);
+   * @endcode
+   */
+  void begin(const verifyClientContextCallback &verifyClient,
+    const protocolHandlerContextCallback &protocolHandler, void *context);
   /** @brief Disconnects all clients. */
   void shutdown();
 
+  /**
+   * @brief Registers subprotocols supported by the server, connections refer
+   * to these strings (see WebSocket::getProtocol()).
+   * @code{.cpp}
+   * const char *const protocols[]{"chat", "superchat"};
+   * server.setProtocols(protocols, 2);
+   * @endcode
+   * @note The table is not copied. Without it no subprotocol is negotiated.
+   */
+  void setProtocols(const char *const protocols[], uint8_t count);
+  /**
+   * @brief Serves the assets to GET requests without Upgrade header, other
+   * requests are still rejected with 426.
+   * @note The table (in PROGMEM) is not copied. Connection is closed after
+   * each response (no keep-alive).
+   */
+  void setAssets(const StaticAsset assets[], uint8_t count);
+  /**
+   * @brief Accepts upgrades only for paths of the table (first matching
+   * entry wins), others are rejected with 404. A route over its limit
+   * rejects with 503.
+   * @note The table (in PROGMEM) is not copied. Without it every path is
+   * accepted.
+   * @see WebSocket::getRoute()
+   */
+  void setRoutes(const Route routes[], uint8_t count);
+
   /** @brief Sends message to all connected clients. */
   void broadcast(
     const WebSocket::DataType dataType, const char *message, uint16_t length);
 
-  /** @note Call this in main loop. */
-  void listen();
+  /**
+   * @note Call this in main loop. Handshake requests are read as they
+   * arrive, a client that does not complete its request within
+   * kTimeoutInterval is rejected.
+   * @return Number of connections (or handshakes, or the post queue) left
+   * with unread data (quota or time budget exhausted, see setListenPolicy()).
+   */
+  uint8_t listen();
+  /**
+   * @brief
+   * @code{.cpp}
+   * WebSocketServer::ListenPolicy policy;
+   * policy.framesPerClient = 4;
+   * policy.timeBudget = 2000; // 2 ms
+   * server.setListenPolicy(policy);
+   * @endcode
+   */
+  void setListenPolicy(const ListenPolicy &);
 
   /** @return Amount of connected clients. */
   uint8_t countClients() const;
 
+#ifdef _TRAFFIC_STATS
+  /** @return Snapshot of the traffic counters. */
+  WebSocketServerStats getStats() const;
+  /** @brief Resets counters of the server and of every connection. */
+  void resetStats();
+#endif
+#ifdef _LATENCY_HISTOGRAMS
+  /**
+   * @return Durations of listen() calls, frame parsing, onMessage callbacks
+   * and frame writes of all connections (call reset() to start over).
+   * @code{.cpp}
+   * const auto &latency = server.getHistograms();
+   * Serial.println(latency.dispatch.getPercentile(99.0));
+   * @endcode
+   */
+  LatencyHistograms &getHistograms();
+#endif
+
+  /**
+   * @brief Lets connections assemble messages larger than their own buffer
+   * in a buffer borrowed from the pool.
+   * @note Call before begin(), the pool has to outlive the server.
+   */
+  void setBufferPool(MessageBufferPool *pool);
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  /**
+   * @brief Messages posted to the queue (from any task) are sent by listen()
+   * (within the time budget of the listen policy), nullptr disables.
+   * @note The queue has to outlive the server.
+   */
+  void setPostQueue(PostQueue *queue);
+#endif
+
   /**
    * @brief
    * @code{.cpp}
@@ -81,16 +328,55 @@ public:
    * @endcode
    * @param callback Function that will be called for every successfully
    * connected client.
+   * @param context Initial user data of every accepted client (see
+   * WebSocket::getUserData()), e.g. the application object.
+   */
+  void onConnection(
+    const onConnectionCallback &callback, void *context = nullptr);
+
+protected:
+  /**
+   * @param sockets Array of maxConnections slots, owned by the derived class.
    */
-  void onConnection(const onConnectionCallback &callback);
+  WebSocketServerBase(
+    uint16_t port, WebSocket *sockets[], uint8_t maxConnections);
+
+  /** @cond */
+  virtual WebSocket *_createWebSocket(
+    const NetClient &, const char *protocol) const = 0;
+  /** @endcond */
 
 private:
   /** @cond */
   WebSocket *_getWebSocket(NetClient &) const;
+  bool _isPendingRequest(NetClient &) const;
 
-  /// @param[out] protocol
-  bool _handleRequest(NetClient &, char selectedProtocol[]);
-  bool _isValidGET(char *line);
+  /// Outcome of the handshake request read so far
+  enum class RequestState : uint8_t {
+    /// Waiting for the rest of the request
+    PENDING,
+    /// Answered (rejected or served an asset), client is stopped
+    CLOSED,
+    /// Switched protocols
+    ACCEPTED,
+  };
+
+  /// @return Entry for the request of a new client or nullptr (all taken)
+  HandshakeRequest *_findFreeRequest();
+  bool _hasFreeSlot() const;
+  /// Reads what has arrived of the request, without waiting for the rest
+  /// @param[out] selectedProtocol Entry of the protocol table or nullptr
+  /// @param[out] route Entry of the route table or nullptr
+  RequestState _handleRequest(
+    HandshakeRequest &, const char *&selectedProtocol, const Route *&route);
+  /// @return Number of requests left unread (time budget exhausted)
+  uint8_t _handleRequests(uint32_t startTime);
+  void _addWebSocket(
+    const NetClient &, const char *selectedProtocol, const Route *);
+  const char *_selectProtocol(char *requestedProtocols,
+    const char *const protocols[], uint8_t count) const;
+  /// @param[out] path Request path (without query), kMaxPathSize at least
+  bool _isValidGET(char *line, char *path);
   bool _isValidUpgrade(const char *line);
   bool _isValidConnection(char *value);
   bool _isValidVersion(uint8_t version);
@@ -98,17 +384,100 @@ private:
   void _rejectRequest(NetClient &, const WebSocketError code);
   void _acceptRequest(NetClient &, const char *secKey, const char *protocol);
 
+  /// @return Entry of the asset table (copied from flash) or false
+  bool _findAsset(const char *path, StaticAsset &) const;
+  /// @return Entry of the route table (copied from flash to the 2nd
+  /// argument) or nullptr
+  const Route *_findRoute(const char *path, Route &) const;
+  uint8_t _countConnections(const Route *) const;
+  /// @param buffer Request buffer, reused for the body
+  void _serveAsset(NetClient &, const StaticAsset &, const char *ifNoneMatch,
+    bool acceptsGzip, char *buffer, uint8_t size);
+
   void _cleanDeadConnections();
+  /// @return false if data was left unread (quota or time budget exhausted)
+  bool _drainWebSocket(WebSocket &, uint32_t startTime);
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  /// Sends messages posted so far (not those posted meanwhile)
+  /// @return false if the time budget ran out before the queue got empty
+  bool _drainPostQueue(uint32_t startTime);
+#endif
+  /// Deletes the connection, keeping its traffic counters
+  void _removeWebSocket(WebSocket *&);
   /** @endcond */
 private:
   NetServer m_server;
-  WebSocket *m_sockets[kMaxConnections]{};
+  WebSocket **m_sockets;
+  const uint8_t m_maxConnections;
+  /// Read one at a time on AVR (see kMaxPendingRequests)
+  HandshakeRequest m_requests[kMaxPendingRequests];
+  MessageBufferPool *m_bufferPool{nullptr};
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_ESP32
+  PostQueue *m_postQueue{nullptr};
+#endif
+
+  ListenPolicy m_listenPolicy;
+  /// Slot served first by the next listen()
+  uint8_t m_nextSlot{0};
+  /// Id of the last accepted connection (see WebSocket::getId())
+  uint32_t m_lastId{0};
+
+  const char *const *m_protocols{nullptr};
+  uint8_t m_protocolCount{0};
+  const StaticAsset *m_assets{nullptr};
+  uint8_t m_assetCount{0};
+  const Route *m_routes{nullptr};
+  uint8_t m_routeCount{0};
 
   verifyClientCallback _verifyClient{nullptr};
   protocolHandlerCallback _protocolHandler{nullptr};
+  verifyClientContextCallback _verifyClientWithContext{nullptr};
+  protocolHandlerContextCallback _protocolHandlerWithContext{nullptr};
+  void *m_callbackContext{nullptr};
   onConnectionCallback _onConnection{nullptr};
+  void *m_connectionContext{nullptr};
+
+#ifdef _TRAFFIC_STATS
+  WebSocketServerStats m_stats;
+#endif
+#ifdef _LATENCY_HISTOGRAMS
+  LatencyHistograms m_latency;
+#endif
+};
+
+/**
+ * @class BasicWebSocketServer
+ * @brief Server with up to MaxConnections clients, each with a data buffer of
+ * BufferSize bytes.
+ * @code{.cpp}
+ * BasicWebSocketServer<2, 1024> server{3000}; // few clients, large frames
+ * @endcode
+ */
+template <uint8_t MaxConnections = kMaxConnections,
+  uint16_t BufferSize = kBufferMaxSize>
+class BasicWebSocketServer final : public WebSocketServerBase {
+public:
+  /**
+   * @brief Initializes server on given port.
+   * @note Don't forget to call begin()
+   */
+  BasicWebSocketServer(uint16_t port = 3000)
+    : WebSocketServerBase{port, m_slots, MaxConnections} {}
+  ~BasicWebSocketServer() { shutdown(); }
+
+private:
+  WebSocket *_createWebSocket(
+    const NetClient &client, const char *protocol) const override {
+    return new BasicWebSocket<BufferSize>{client, protocol};
+  }
+
+private:
+  WebSocket *m_slots[MaxConnections]{};
 };
 
+/** Server with the default limits (kMaxConnections, kBufferMaxSize). */
+using WebSocketServer = BasicWebSocketServer<>;
+
 /**
  * @example ./simple-server/simple-server.ino
  * Example usage of WebSocketServer class
@@ -4,9 +4,12 @@
 
 /**
  * @def _DEBUG Enables __debugOutput function.
- * @def _DUMP_HANDSHAKE Prints any handshake request/response on Serial output.
- * @def _DUMP_HEADER Prints frame header on Serial output.
- * @def _DUMP_FRAME_DATA Prints frame data on Serial output.
+ * @def _TRACE Reports frames, handshakes, state changes and closes to the
+ * trace sink (see setTraceSink()).
+ * @def _TRAFFIC_STATS Enables traffic counters (WebSocket::getStats(),
+ * WebSocketServerBase::getStats()).
+ * @def _LATENCY_HISTOGRAMS Enables latency histograms of listen() (see
+ * WebSocketServerBase::getHistograms()).
  */
 
 /**
@@ -15,18 +18,47 @@
  *  - ETHERNET_CONTROLLER_W5X00
  *  - ETHERNET_CONTROLLER_ENC28J60
  *  - NETWORK_CONTROLLER_WIFI
+ *  - NETWORK_CONTROLLER_SIMULATED (in-memory, see SimNetwork)
  */
 
 //#define _DEBUG
-//#define _DUMP_HANDSHAKE
-//#define _DUMP_HEADER
-//#define _DUMP_FRAME_DATA
+//#define _TRACE
+//#define _TRAFFIC_STATS
+//#define _LATENCY_HISTOGRAMS
 
 #ifndef NETWORK_CONTROLLER
 #  define NETWORK_CONTROLLER ETHERNET_CONTROLLER_W5X00
 #endif
 
-/** Maximum size of data buffer - frame payload (in bytes). */
+/**
+ * Default maximum size of data buffer - frame payload (in bytes).
+ * @see BasicWebSocketClient, BasicWebSocketServer
+ */
 constexpr uint16_t kBufferMaxSize{256};
+/**
+ * Frames a connection reads in a single listen() call while data is
+ * available (0 = no limit), so a burst of small messages is not spread over
+ * several loop iterations.
+ * @see WebSocketServerBase::ListenPolicy, WebSocketClientBase::listen()
+ */
+constexpr uint8_t kMaxFramesPerListen{8};
+/**
+ * Latency histograms split each power of two into 2^kLatencySubBucketBits
+ * buckets: 3 = percentiles within 12.5%, 290 bytes per histogram (four per
+ * server/client), 2 = within 25%, 154 bytes (e.g. for AVR).
+ * @see LatencyHistogram
+ */
+constexpr uint8_t kLatencySubBucketBits{3};
+/** Durations from 2^kLatencyRangeBits us (~1 s) share the last bucket. */
+constexpr uint8_t kLatencyRangeBits{20};
 /** Maximum time to wait for endpoint response (in milliseconds). */
 constexpr uint16_t kTimeoutInterval{5000};
+/**
+ * Handshake requests a server reads at the same time (~340 bytes each, part
+ * of the server object), other clients wait in the backlog meanwhile.
+ */
+#if PLATFORM_ARCH == PLATFORM_ARCHITECTURE_AVR
+constexpr uint8_t kMaxPendingRequests{1};
+#else
+constexpr uint8_t kMaxPendingRequests{2};
+#endif
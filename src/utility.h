@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Clock.h"
 #include "platform.h"
 
 #define SAFE_DELETE(ptr)                                                       \
@@ -24,6 +25,18 @@
 #  define __debugOutput(...)
 #endif
 
+#ifdef _TRAFFIC_STATS
+#  define __updateStats(...) __VA_ARGS__
+#else
+#  define __updateStats(...)
+#endif
+
+#ifdef _LATENCY_HISTOGRAMS
+#  define __measureLatency(...) __VA_ARGS__
+#else
+#  define __measureLatency(...)
+#endif
+
 void printf(const __FlashStringHelper *fmt, ...);
 
 namespace net {